@@ -0,0 +1,176 @@
+#!/bin/sh
+#
+# bench.sh
+#
+# Compiler and flag matrix benchmark for the generated C code. Every program
+# in the corpus is transpiled once and its output is compiled with each
+# available compiler at -O0 to -O3, with and without LTO and -march=native.
+# For each build the compile time, the binary size and the best run time
+# over several runs are recorded, and printed as one comparison table.
+#
+# Usage:
+#   bench/bench.sh [-H] [-o results.json] [-r runs] [-- brainfuck2c options]
+#
+# With -H the programs are generated with --runtime-header, and the shared
+# runtime header is precompiled once per compiler and flag set (as a gcc
+# .gch or a clang .pch); the time this takes is listed under the program
+# name bf2c_runtime.h.
+#
+# Environment:
+#   BF2C     Transpiler to use (default: build ./brainfuck2c from the tree)
+#   CORPUS   Directory of .bf programs (default: bench/corpus). A program
+#            NAME.bf reads NAME.in as its input if that file exists.
+#   CCS      Compilers to try (default: "gcc clang"); missing ones are skipped
+#   LEVELS   Optimization levels (default: "0 1 2 3")
+#   WORK     Directory for generated files (default: bench/work)
+#
+# The JSON results list one record per build, with every run time, and can
+# be compared with bench/compare.
+#
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$BENCH_DIR")
+CORPUS=${CORPUS:-$BENCH_DIR/corpus}
+CCS=${CCS:-"gcc clang"}
+LEVELS=${LEVELS:-"0 1 2 3"}
+WORK=${WORK:-$BENCH_DIR/work}
+RESULTS=$WORK/results.json
+RUNS=3
+HEADER=0
+
+while [ $# -gt 0 ]; do
+    case $1 in
+        -H) HEADER=1; shift ;;
+        -o) RESULTS=$2; shift 2 ;;
+        -r) RUNS=$2; shift 2 ;;
+        --) shift; break ;;
+        *) echo "Usage: $0 [-H] [-o results.json] [-r runs] [-- brainfuck2c options]" >&2; exit 1 ;;
+    esac
+done
+
+mkdir -p "$WORK"
+if [ -z "$BF2C" ]; then
+    BF2C=$WORK/brainfuck2c
+    gcc -O2 -o "$BF2C" "$ROOT/brainfuck2c.c"
+fi
+if [ $HEADER -eq 1 ]; then
+    "$BF2C" --emit-runtime-header > "$WORK/bf2c_runtime.h"
+    rm -rf "$WORK/bf2c_runtime.h.gch" "$WORK"/bf2c_runtime.*.pch
+    mkdir "$WORK/bf2c_runtime.h.gch"
+    set -- --runtime-header "$@"
+fi
+
+# Prints the current time in nanoseconds.
+now() {
+    date +%s%N
+}
+
+# Prints the difference of two nanosecond times in seconds.
+seconds() {
+    awk -v a="$1" -v b="$2" 'BEGIN { printf "%.6f", (b - a) / 1e9 }'
+}
+
+# Prints the size of a file in bytes.
+size_of() {
+    wc -c < "$1" | tr -d ' '
+}
+
+# Appends one build to the table and the JSON results.
+record() {
+    printf '%-14s %-6s %-26s %10s %10s %10s\n' "$1" "$2" "$3" "$4" "$5" "$6" >> "$TABLE"
+    [ $first -eq 1 ] || printf ',\n' >> "$RESULTS"
+    first=0
+    printf '  {"program": "%s", "compiler": "%s", "flags": "%s", "binary": "%s", "input": "%s", ' \
+        "$1" "$2" "$3" "$7" "$8" >> "$RESULTS"
+    printf '"compile_seconds": %s, "size_bytes": %s, "run_seconds": [%s]}' "$4" "$5" "$9" >> "$RESULTS"
+}
+
+# Precompiles the runtime header for one compiler and flag set, once, and
+# sets pch to the options that make the compiler use it. gcc picks the
+# matching file from the bf2c_runtime.h.gch directory by itself.
+precompile() {
+    if $1 --version 2> /dev/null | grep -q clang; then
+        file=$WORK/bf2c_runtime.$3.pch
+        pch="-include-pch $file"
+    else
+        file=$WORK/bf2c_runtime.h.gch/$3
+        pch=
+    fi
+    if [ ! -f "$file" ]; then
+        start=$(now)
+        $1 $2 -x c-header -o "$file" "$WORK/bf2c_runtime.h"
+        record bf2c_runtime.h "$1" "$2" "$(seconds "$start" "$(now)")" "$(size_of "$file")" - "$file" "" ""
+    fi
+}
+
+# Runs a binary on its input, discarding the output.
+run() {
+    if [ -n "$2" ]; then
+        "$1" < "$2" > /dev/null
+    else
+        "$1" < /dev/null > /dev/null
+    fi
+}
+
+TABLE=$WORK/table.txt
+: > "$TABLE"
+printf '[\n' > "$RESULTS"
+first=1
+
+for source in "$CORPUS"/*.bf; do
+    name=$(basename "$source" .bf)
+    input=
+    if [ -f "$CORPUS/$name.in" ]; then
+        input=$CORPUS/$name.in
+    fi
+    "$BF2C" "$@" "$source" > "$WORK/$name.c"
+
+    for cc in $CCS; do
+        if ! command -v "$cc" > /dev/null 2>&1; then
+            continue
+        fi
+        for level in $LEVELS; do
+            for lto in "" "-flto"; do
+                for arch in "" "-march=native"; do
+                    flags="-O$level${lto:+ $lto}${arch:+ $arch}"
+                    config=$(echo "$cc$flags" | tr -c 'A-Za-z0-9\n' '_')
+                    binary=$WORK/$name.$config
+                    pch=
+                    if [ $HEADER -eq 1 ]; then
+                        precompile "$cc" "$flags" "$config"
+                    fi
+
+                    start=$(now)
+                    if ! $cc $flags $pch -o "$binary" "$WORK/$name.c" 2> /dev/null; then
+                        echo "$name: $cc $flags failed to compile" >&2
+                        continue
+                    fi
+                    compile=$(seconds "$start" "$(now)")
+                    size=$(size_of "$binary")
+
+                    times=
+                    best=
+                    i=0
+                    while [ $i -lt "$RUNS" ]; do
+                        start=$(now)
+                        run "$binary" "$input"
+                        t=$(seconds "$start" "$(now)")
+                        times="$times${times:+, }$t"
+                        best=$(awk -v a="$best" -v b="$t" 'BEGIN { print (a == "" || b < a) ? b : a }')
+                        i=$((i + 1))
+                    done
+
+                    record "$name" "$cc" "$flags" "$compile" "$size" "$best" "$binary" "$input" "$times"
+                done
+            done
+        done
+    done
+done
+
+printf '\n]\n' >> "$RESULTS"
+
+printf '%-14s %-6s %-26s %10s %10s %10s\n' program cc flags compile_s size_B run_s
+cat "$TABLE"
+echo "Results written to $RESULTS" >&2
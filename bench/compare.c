@@ -0,0 +1,479 @@
+/*
+ * compare.c
+ *
+ * Compares two result sets written by bench/bench.sh, typically one from a
+ * baseline tree and one from a changed tree. The run times recorded by the
+ * harness are too noisy on a shared machine to decide anything, so the
+ * binaries of every build present in both sets are run again here: pinned
+ * to one CPU, after a few warmup runs, and with the trials of the two sides
+ * interleaved so that drift in machine load affects both alike. For each
+ * build the tool reports the change in mean run time with a 95% confidence
+ * interval, and fails it when the interval shows a slowdown larger than the
+ * threshold. A build whose interval reaches past the threshold without
+ * lying wholly beyond it is inconclusive: the runs were too noisy to tell,
+ * and more trials are needed.
+ *
+ * Build:
+ *   gcc -O2 -o bench/compare bench/compare.c -lm
+ *
+ * Usage:
+ *   bench/compare [-n trials] [-w warmup] [-c cpu] [-t percent] base.json new.json
+ *
+ * Options:
+ *   -n trials    Timed runs of each side (default: 10)
+ *   -w warmup    Untimed runs of each side first (default: 2)
+ *   -c cpu       CPU to pin the runs to (default: 0; -1 disables pinning)
+ *   -t percent   Slowdown that fails a build (default: 5)
+ *
+ * The exit status is 1 if any build failed, and otherwise 2 if any was
+ * inconclusive.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_TRIALS 1000
+
+/*---------------------------------------------------------------
+ * Result Sets: Reading the Harness's JSON
+ *--------------------------------------------------------------*/
+
+// One build from a result set.
+typedef struct {
+    char *program;
+    char *compiler;
+    char *flags;
+    char *binary;
+    char *input;
+    int numRuns;            // Run times recorded by the harness
+} Build;
+
+typedef struct {
+    Build *builds;
+    int numBuilds;
+} ResultSet;
+
+/*
+ * read_file()
+ *
+ * Reads a whole file into a NUL-terminated buffer.
+ */
+char* read_file(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    char *data = NULL;
+    size_t len = 0, capacity = 0, n;
+    if (!fp) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    do {
+        if (len + 4096 + 1 > capacity) {
+            capacity = capacity ? 2 * capacity : 65536;
+            data = realloc(data, capacity);
+            if (!data) {
+                perror("Memory allocation failed in read_file()");
+                exit(EXIT_FAILURE);
+            }
+        }
+        n = fread(data + len, 1, 4096, fp);
+        len += n;
+    } while (n > 0);
+    fclose(fp);
+    data[len] = '\0';
+    return data;
+}
+
+/*
+ * skip_space()
+ *
+ * Returns the first non-whitespace character at or after p.
+ */
+const char* skip_space(const char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') {
+        p++;
+    }
+    return p;
+}
+
+/*
+ * parse_string()
+ *
+ * Parses the JSON string at *p, which must start with a quote, and returns
+ * a copy of its contents. Only the escapes \" and \\ are expected, since the
+ * harness writes plain paths and flags.
+ */
+char* parse_string(const char **p, const char *path) {
+    const char *s = *p + 1;
+    size_t len = 0;
+    char *out;
+    if (**p != '"') {
+        fprintf(stderr, "%s: expected a string\n", path);
+        exit(EXIT_FAILURE);
+    }
+    out = malloc(strlen(s) + 1);
+    if (!out) {
+        perror("Memory allocation failed in parse_string()");
+        exit(EXIT_FAILURE);
+    }
+    while (*s && *s != '"') {
+        if (*s == '\\' && s[1]) {
+            s++;
+        }
+        out[len++] = *s++;
+    }
+    if (*s != '"') {
+        fprintf(stderr, "%s: unterminated string\n", path);
+        exit(EXIT_FAILURE);
+    }
+    out[len] = '\0';
+    *p = s + 1;
+    return out;
+}
+
+/*
+ * skip_value()
+ *
+ * Skips the JSON number or array of numbers at *p, returning the number of
+ * elements an array had.
+ */
+int skip_value(const char **p) {
+    int count = 0;
+    if (**p != '[') {
+        strtod(*p, (char **)p);
+        return 1;
+    }
+    *p = skip_space(*p + 1);
+    while (**p && **p != ']') {
+        strtod(*p, (char **)p);
+        count++;
+        *p = skip_space(*p);
+        if (**p == ',') {
+            *p = skip_space(*p + 1);
+        }
+    }
+    if (**p == ']') {
+        (*p)++;
+    }
+    return count;
+}
+
+/*
+ * load_results()
+ *
+ * Reads the array of build records written by bench/bench.sh.
+ */
+ResultSet load_results(const char *path) {
+    ResultSet set = {NULL, 0};
+    char *data = read_file(path);
+    const char *p = skip_space(data);
+    if (*p++ != '[') {
+        fprintf(stderr, "%s: not a result set\n", path);
+        exit(EXIT_FAILURE);
+    }
+    for (p = skip_space(p); *p == '{'; p = skip_space(p)) {
+        Build build = {NULL, NULL, NULL, NULL, NULL, 0};
+        for (p = skip_space(p + 1); *p == '"'; p = skip_space(p)) {
+            char *key = parse_string(&p, path);
+            p = skip_space(p);
+            if (*p++ != ':') {
+                fprintf(stderr, "%s: expected ':'\n", path);
+                exit(EXIT_FAILURE);
+            }
+            p = skip_space(p);
+            if (*p == '"') {
+                char *value = parse_string(&p, path);
+                char **field = strcmp(key, "program") == 0 ? &build.program :
+                               strcmp(key, "compiler") == 0 ? &build.compiler :
+                               strcmp(key, "flags") == 0 ? &build.flags :
+                               strcmp(key, "binary") == 0 ? &build.binary :
+                               strcmp(key, "input") == 0 ? &build.input : NULL;
+                if (field) {
+                    free(*field);
+                    *field = value;
+                } else {
+                    free(value);
+                }
+            } else {
+                int count = skip_value(&p);
+                if (strcmp(key, "run_seconds") == 0) {
+                    build.numRuns = count;
+                }
+            }
+            free(key);
+            p = skip_space(p);
+            if (*p == ',') {
+                p++;
+            }
+        }
+        if (*p++ != '}' || !build.program || !build.compiler || !build.flags || !build.binary) {
+            fprintf(stderr, "%s: incomplete build record\n", path);
+            exit(EXIT_FAILURE);
+        }
+        set.builds = realloc(set.builds, (set.numBuilds + 1) * sizeof(Build));
+        if (!set.builds) {
+            perror("Memory allocation failed in load_results()");
+            exit(EXIT_FAILURE);
+        }
+        set.builds[set.numBuilds++] = build;
+        p = skip_space(p);
+        if (*p == ',') {
+            p++;
+        }
+    }
+    free(data);
+    return set;
+}
+
+/*
+ * free_results()
+ *
+ * Frees a result set.
+ */
+void free_results(ResultSet *set) {
+    for (int i = 0; i < set->numBuilds; i++) {
+        free(set->builds[i].program);
+        free(set->builds[i].compiler);
+        free(set->builds[i].flags);
+        free(set->builds[i].binary);
+        free(set->builds[i].input);
+    }
+    free(set->builds);
+}
+
+/*---------------------------------------------------------------
+ * Trials: Pinned, Interleaved Runs
+ *--------------------------------------------------------------*/
+
+/*
+ * run_once()
+ *
+ * Runs a binary on its input with its output discarded, pinned to the given
+ * CPU unless it is negative, and returns the wall-clock time it took in
+ * seconds. Exits if the program does not run successfully.
+ */
+double run_once(const Build *build, int cpu) {
+    struct timespec start, end;
+    int status;
+    pid_t pid;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int in = open(build->input && *build->input ? build->input : "/dev/null", O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        if (in < 0 || out < 0 || dup2(in, 0) < 0 || dup2(out, 1) < 0) {
+            perror(build->binary);
+            _exit(127);
+        }
+#if defined(__linux__)
+        if (cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+                perror("sched_setaffinity");
+                _exit(127);
+            }
+        }
+#else
+        (void)cpu;
+#endif
+        execl(build->binary, build->binary, (char *)NULL);
+        perror(build->binary);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        exit(EXIT_FAILURE);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s did not run successfully\n", build->binary);
+        exit(EXIT_FAILURE);
+    }
+    return (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/*
+ * t_critical()
+ *
+ * Returns the two-sided 95% critical value of Student's t distribution with
+ * the given degrees of freedom.
+ */
+double t_critical(double df) {
+    static const double table[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    int d = (int)df;
+    if (d < 1) {
+        d = 1;
+    }
+    return d <= 30 ? table[d - 1] : 1.960 + 2.4 / d;
+}
+
+/*
+ * mean_and_variance()
+ *
+ * Computes the sample mean and variance of n values.
+ */
+void mean_and_variance(const double *values, int n, double *mean, double *variance) {
+    double sum = 0, squares = 0;
+    for (int i = 0; i < n; i++) {
+        sum += values[i];
+    }
+    *mean = sum / n;
+    for (int i = 0; i < n; i++) {
+        squares += (values[i] - *mean) * (values[i] - *mean);
+    }
+    *variance = n > 1 ? squares / (n - 1) : 0;
+}
+
+/*---------------------------------------------------------------
+ * Main Function
+ *--------------------------------------------------------------*/
+
+/*
+ * parse_integer()
+ *
+ * Parses the value of an integer option, exiting with an error message if
+ * it is not a number from low to high.
+ */
+int parse_integer(int opt, const char *value, long low, long high) {
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || number < low || number > high) {
+        fprintf(stderr, "Invalid value for -%c: '%s' (expected %ld to %ld)\n", opt, value, low, high);
+        exit(EXIT_FAILURE);
+    }
+    return (int)number;
+}
+
+/*
+ * parse_percent()
+ *
+ * Parses the value of a percentage option, exiting with an error message if
+ * it is not a positive number of at most 1000.
+ */
+double parse_percent(int opt, const char *value) {
+    char *end;
+    double percent = strtod(value, &end);
+    if (end == value || *end != '\0' || !(percent > 0 && percent <= 1000)) {
+        fprintf(stderr, "Invalid value for -%c: '%s' (expected a positive percentage)\n", opt, value);
+        exit(EXIT_FAILURE);
+    }
+    return percent;
+}
+
+int main(int argc, char *argv[]) {
+    int trials = 10, warmup = 2, cpu = 0, opt, failed = 0, inconclusive = 0, compared = 0;
+    double threshold = 5;
+    static double base[MAX_TRIALS], changed[MAX_TRIALS];
+
+    while ((opt = getopt(argc, argv, "n:w:c:t:")) != -1) {
+        switch (opt) {
+            case 'n': trials = parse_integer(opt, optarg, 2, MAX_TRIALS); break;
+            case 'w': warmup = parse_integer(opt, optarg, 0, MAX_TRIALS); break;
+            case 'c': cpu = parse_integer(opt, optarg, -1, 65535); break;
+            case 't': threshold = parse_percent(opt, optarg); break;
+            default:  optind = argc + 1; break;
+        }
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "Usage: %s [-n trials] [-w warmup] [-c cpu] [-t percent] base.json new.json\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    ResultSet before = load_results(argv[optind]);
+    ResultSet after = load_results(argv[optind + 1]);
+
+    printf("%-14s %-6s %-26s %10s %10s %9s %19s  %s\n",
+           "program", "cc", "flags", "base_ms", "new_ms", "delta", "95% CI", "result");
+    for (int i = 0; i < before.numBuilds; i++) {
+        Build *a = &before.builds[i], *b = NULL;
+        if (a->numRuns == 0) {
+            continue;   // A precompiled header, not a program
+        }
+        for (int j = 0; j < after.numBuilds && !b; j++) {
+            Build *c = &after.builds[j];
+            if (c->numRuns > 0 && strcmp(a->program, c->program) == 0 &&
+                strcmp(a->compiler, c->compiler) == 0 && strcmp(a->flags, c->flags) == 0) {
+                b = c;
+            }
+        }
+        if (!b) {
+            continue;
+        }
+
+        for (int w = 0; w < warmup; w++) {
+            run_once(a, cpu);
+            run_once(b, cpu);
+        }
+        for (int t = 0; t < trials; t++) {
+            // Alternate which side goes first so neither always runs warm.
+            if (t % 2 == 0) {
+                base[t] = run_once(a, cpu);
+                changed[t] = run_once(b, cpu);
+            } else {
+                changed[t] = run_once(b, cpu);
+                base[t] = run_once(a, cpu);
+            }
+        }
+
+        // Welch's interval for the difference of the means, relative to
+        // the baseline mean.
+        double meanA, varA, meanB, varB;
+        mean_and_variance(base, trials, &meanA, &varA);
+        mean_and_variance(changed, trials, &meanB, &varB);
+        double seA = varA / trials, seB = varB / trials, se = sqrt(seA + seB);
+        double df = se > 0 ? pow(seA + seB, 2) / (seA * seA / (trials - 1) + seB * seB / (trials - 1)) : trials - 1;
+        double margin = t_critical(df) * se;
+        double delta = 100 * (meanB - meanA) / meanA;
+        double low = 100 * (meanB - meanA - margin) / meanA;
+        double high = 100 * (meanB - meanA + margin) / meanA;
+        const char *result = "same";
+        if (low > threshold) {
+            result = "FAIL";
+            failed++;
+        } else if (high > threshold) {
+            // The slowdown may or may not exceed the threshold.
+            result = "INCONCLUSIVE";
+            inconclusive++;
+        } else if (low > 0) {
+            result = "slower";
+        } else if (high < 0) {
+            result = "faster";
+        }
+        printf("%-14s %-6s %-26s %10.3f %10.3f %+8.1f%% [%+7.1f%%, %+7.1f%%]  %s\n",
+               a->program, a->compiler, a->flags, 1000 * meanA, 1000 * meanB, delta, low, high, result);
+        fflush(stdout);
+        compared++;
+    }
+
+    if (compared == 0) {
+        fprintf(stderr, "No builds in common between %s and %s\n", argv[optind], argv[optind + 1]);
+    } else {
+        printf("%d of %d builds %s more than %.1f%% slower\n", failed, compared,
+               failed == 1 ? "is" : "are", threshold);
+        if (inconclusive > 0) {
+            printf("%d %s too noisy to tell; run more trials with -n\n", inconclusive,
+                   inconclusive == 1 ? "build is" : "builds are");
+        }
+    }
+    free_results(&before);
+    free_results(&after);
+    return failed ? 1 : inconclusive ? 2 : 0;
+}
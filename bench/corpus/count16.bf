@@ -0,0 +1,3 @@
+Adds one to a sixteen bit number held in two cells 255 cubed times
+using scratch cells for the carry and prints both bytes
+-[>-[>-[>+>>+<<[>>-<<[>>>+<<<-]]>>>[<<<+>>>-]<[<+>-]<<<-]<-]<-]>>>.>.[-]<[-]++++++++++.
@@ -0,0 +1,2 @@
+Writes 65025 bytes one at a time to stress the output path
+-[>-[>+.<-]<-]
@@ -0,0 +1,3 @@
+Grows a run of marked cells one at a time and scans it from end to end
+on every step so the pointer moves across most of the tape
+-[>>------[>[>]+[<]>-]>[>]<[-<]<<-]++++++++[>++++++++<-]>+.[-]++++++++++.
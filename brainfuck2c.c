@@ -19,19 +19,152 @@
  *
  * Usage:
  *   Compile: gcc brainfuck2c.c -o brainfuck2c
- *   Run:     ./brainfuck2c [input.bf] > output.c
+ *   Run:     ./brainfuck2c [options] [input.bf] > output.c
  *
- * If no input file is specified, it reads from standard input.
+ * If no input file is specified, it reads from standard input. Inputs
+ * compressed with gzip or zstd are read if brainfuck2c is compiled with
+ * -DBF2C_WITH_ZLIB -lz or -DBF2C_WITH_ZSTD -lzstd.
  *
- * The generated C code creates a memory tape of TAPE_SIZE cells and uses
- * standard C I/O (getchar/putchar) for Brainfuck’s input/output.
+ * Options:
+ *   --profile-generate[=FILE]  Instrument the generated program so that it
+ *                              writes per-loop execution counts and
+ *                              entry-value histograms to FILE (default:
+ *                              bf2c.profile) when it exits.
+ *   --profile-use=FILE         Read counts written by an instrumented build
+ *                              and use them to guide code generation.
+ *   --memoize                  Cache the effect of pure loops at run time and
+ *                              replay it when a loop is entered again with the
+ *                              same surrounding cells.
+ *   --hybrid                   Compile only hot loops (by profile, or loops
+ *                              nested in other loops without one) to C and
+ *                              run the rest from an embedded bytecode blob.
+ *   --flat-depth=N             Emit loops nested deeper than N levels as
+ *                              labels and conditional gotos instead of
+ *                              nested while blocks (default: 64).
+ *   --resumable                Emit the program as a session object whose
+ *                              bf_session_resume() returns BF_NEED_INPUT
+ *                              instead of blocking when input runs out.
+ *   --pipeline A.bf B.bf ...   Fuse the shell pipeline "A | B | ..." into one
+ *                              program that runs each stage on a thread,
+ *                              connected by in-memory ring buffers.
+ *   --batch                    Emit a program that runs many inputs in
+ *                              lockstep: each file argument is one input,
+ *                              and its output is written to FILE.out.
+ *   --max-steps=N              Stop the generated program once its loops
+ *                              have executed N operations.
+ *   --max-output=N             Stop it before it writes more than N bytes.
+ *   --timeout=SECONDS          Stop it after SECONDS of wall-clock time.
+ *   --checkpoint[=FILE]        Let the generated program save its state to
+ *                              FILE (default: bf2c.checkpoint) on SIGUSR1,
+ *                              and resume from it when run with --restore.
+ *   --checkpoint-interval=SECONDS
+ *                              Also save a checkpoint after every SECONDS of
+ *                              CPU time.
+ *   --remarks[=FILE]           Report, per loop, the passes that applied
+ *                              and why the others did not, to FILE or to
+ *                              standard error.
+ *   --runtime-header           Include the runtime from bf2c_runtime.h
+ *                              instead of emitting it into the program.
+ *   --emit-runtime-header      Print bf2c_runtime.h and exit.
+ *   --emit-bfc=FILE            Write the optimized program to FILE as
+ *                              bytecode instead of printing C.
+ *   --run=FILE                 Run a bytecode file written by --emit-bfc.
+ *   --jobs=N                   Analyze the top-level loops on N threads
+ *                              (default: 1). The output does not change.
+ *   --line-directives          Precede each loop with a #line directive
+ *                              naming its line in the Brainfuck source.
+ *   --check FILE...            Only check that the brackets of each file
+ *                              are balanced, without generating code.
+ *   --opt-fuel=N               Stop optimizing once the transpile-time
+ *                              evaluations have taken N steps in total.
+ *   --opt-budget-ms=N          Stop optimizing after N milliseconds.
+ *
+ * The generated C code creates a memory tape of TAPE_SIZE cells and uses a
+ * small buffered I/O runtime (bf_getc/bf_putc) for Brainfuck’s input/output.
+ * As with getchar(), end of input stores 255 in the current cell.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
+#define BFC_MMAP 1
+#define OPT_THREADS 1
+#else
+#define BFC_MMAP 0
+#define OPT_THREADS 0
+#endif
+#ifdef BF2C_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef BF2C_WITH_ZSTD
+#include <zstd.h>
+#endif
 
 #define TAPE_SIZE 30000
+#define DEFAULT_PROFILE_FILE "bf2c.profile"
+#define DEFAULT_CHECKPOINT_FILE "bf2c.checkpoint"
+#define RUNTIME_HEADER "bf2c_runtime.h"
+#define RUNTIME_VERSION 1
+#define BFC_MAGIC "bf2c-bc"
+#define BFC_VERSION 1
+#define BFC_BYTE_ORDER 0x01020304u
+#define BFC_ALIGN 64
+#define PROFILE_MAGIC "bf2c-profile"
+#define PROFILE_VERSION 2
+#define UNROLL_LIMIT 16
+#define MAX_SPECIALIZED 2
+#define MEMO_WINDOW 16
+#define TRANSFORM_FUEL 100000
+#define DEFAULT_FLAT_DEPTH 64
+#define MAX_JOBS 256
+#define NO_POSITION SIZE_MAX
+#define SOURCE_BLOCK 65536
+#define CHECK_BLOCK 65536
+#define WIDE_WINDOW 6
+#define WIDE_SPAN 32
+#define WIDE_SAMPLE_FUEL 4096
+#define WIDE_FUEL (1L << 24)
+
+// Settings taken from the command line.
+typedef struct {
+    const char *inputPath;
+    const char *profileGenerate;    // Profile output path, or NULL
+    const char *profileUse;         // Profile input path, or NULL
+    int memoize;                    // Cache the effect of pure loops
+    int hybrid;                     // Interpret cold code from bytecode
+    int flatDepth;                  // Nesting level above which loops use gotos
+    int resumable;                  // Emit a resumable session instead of main()
+    int pipeline;                   // Fuse all inputs into one pipeline program
+    int batch;                      // Run many inputs in lockstep
+    unsigned long long maxSteps;    // Step limit of the program, or 0
+    unsigned long long maxOutput;   // Output limit in bytes, or 0
+    double timeout;                 // Time limit in seconds, or 0
+    const char *checkpoint;         // Checkpoint file path, or NULL
+    double checkpointInterval;      // CPU seconds between checkpoints, or 0
+    const char *remarks;            // Remarks file path, "" for stderr, or NULL
+    int runtimeHeader;              // Include the shared runtime header
+    int emitRuntimeHeader;          // Print the shared runtime header and exit
+    const char *emitBfc;            // Bytecode file to write instead of C, or NULL
+    const char *runBfc;             // Bytecode file to run, or NULL
+    int jobs;                       // Threads for the loop-local passes
+    int lineDirectives;             // Map loops back to the source with #line
+    int check;                      // Only check the brackets of the inputs
+    long long optFuel;              // Evaluation steps the optimizer may take, or 0
+    unsigned long long optBudgetMs; // Time the optimizer may take, or 0
+    const char **stagePaths;        // Pipeline stage sources, in order
+    int numStagePaths;
+} Options;
+
+Options options;
 
 /*---------------------------------------------------------------
  * Lexer Phase: Token Definitions and Lexing Function
@@ -46,32 +179,231 @@ typedef enum {
     TOKEN_OUTPUT,       // '.'
     TOKEN_INPUT,        // ','
     TOKEN_LOOP_START,   // '['
-    TOKEN_LOOP_END      // ']'
+    TOKEN_LOOP_END,     // ']'
+    TOKEN_WIDE_ADD      // Two-cell addition found by the optimizer
 } TokenType;
 
+// A token is one command of the source. Tokens carry no position: the
+// lexer keeps the offsets of the brackets aside, since only loops and
+// bracket errors are ever reported by position.
 typedef struct {
-    TokenType type;
-    int pos;
+    unsigned char type;
 } Token;
 
+// Formats of an input file, told apart by their magic bytes.
+typedef enum {
+    INPUT_PLAIN,
+    INPUT_GZIP,         // 1f 8b
+    INPUT_ZSTD          // 28 b5 2f fd
+} InputFormat;
+
+// An input file being read, and decompressed if it is compressed. The
+// compressed bytes pass through in[], in blocks of SOURCE_BLOCK.
+typedef struct {
+    FILE *fp;
+    const char *name;           // For error messages
+    InputFormat format;
+    unsigned char in[SOURCE_BLOCK];
+    size_t inStart, inEnd;      // Bytes of in[] not yet decoded
+    int frameEnded;             // Input may end here without being truncated
+    int padding;                // Only zero bytes may follow
+#ifdef BF2C_WITH_ZLIB
+    z_stream gz;
+#endif
+#ifdef BF2C_WITH_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+} Decoder;
+
 /*
- * lex()
+ * open_decoder()
  *
- * Converts the input Brainfuck source string into a dynamic array of tokens.
- * Non-Brainfuck characters are ignored.
+ * Opens an input file, or standard input if path is NULL, and tells its
+ * format from its first bytes. Compressed formats need brainfuck2c to be
+ * built with their library; a compressed input that cannot be read is an
+ * error. Returns NULL, with errno set, if the file cannot be opened.
+ */
+Decoder* open_decoder(const char *path) {
+    FILE *fp = path ? fopen(path, "rb") : stdin;
+    if (!fp) {
+        return NULL;
+    }
+    Decoder *d = calloc(1, sizeof(Decoder));
+    if (!d) {
+        perror("Memory allocation failed in open_decoder()");
+        exit(EXIT_FAILURE);
+    }
+    d->fp = fp;
+    d->name = path ? path : "<stdin>";
+    d->inEnd = fread(d->in, 1, SOURCE_BLOCK, fp);
+    if (d->inEnd >= 2 && d->in[0] == 0x1f && d->in[1] == 0x8b) {
+        d->format = INPUT_GZIP;
+    } else if (d->inEnd >= 4 && d->in[0] == 0x28 && d->in[1] == 0xb5 && d->in[2] == 0x2f && d->in[3] == 0xfd) {
+        d->format = INPUT_ZSTD;
+    }
+#ifdef BF2C_WITH_ZLIB
+    if (d->format == INPUT_GZIP && inflateInit2(&d->gz, 15 + 16) != Z_OK) {
+        fprintf(stderr, "Error: Cannot start decompressing %s\n", d->name);
+        exit(EXIT_FAILURE);
+    }
+#else
+    if (d->format == INPUT_GZIP) {
+        fprintf(stderr, "Error: %s is gzip-compressed; build brainfuck2c with -DBF2C_WITH_ZLIB -lz to read it\n",
+                d->name);
+        exit(EXIT_FAILURE);
+    }
+#endif
+#ifdef BF2C_WITH_ZSTD
+    if (d->format == INPUT_ZSTD && !(d->zstd = ZSTD_createDStream())) {
+        fprintf(stderr, "Error: Cannot start decompressing %s\n", d->name);
+        exit(EXIT_FAILURE);
+    }
+#else
+    if (d->format == INPUT_ZSTD) {
+        fprintf(stderr, "Error: %s is zstd-compressed; build brainfuck2c with -DBF2C_WITH_ZSTD -lzstd to read it\n",
+                d->name);
+        exit(EXIT_FAILURE);
+    }
+#endif
+    return d;
+}
+
+/*
+ * inflate_block()
  *
- * The number of tokens is returned in *numTokens.
- * The caller must free the returned array.
+ * Decompresses as much of the buffered input of a decoder as fits in out,
+ * and returns the number of bytes written. Concatenated frames, as written
+ * by parallel compressors, are decoded one after the other. Zero bytes
+ * after the last frame, as tape drives and dd leave them, are skipped, as
+ * gzip -d does.
  */
-Token* lex(const char* src, int *numTokens) {
-    int capacity = 128;
-    int count = 0;
-    Token* tokens = malloc(capacity * sizeof(Token));
-    if (!tokens) {
-        perror("Memory allocation failed in lex()");
+size_t inflate_block(Decoder *d, char *out, size_t size) {
+    size_t produced = 0;
+    int corrupt = 0;
+    if (d->frameEnded && (d->padding || d->in[d->inStart] == 0)) {
+        d->padding = 1;
+        while (d->inStart < d->inEnd && d->in[d->inStart] == 0) {
+            d->inStart++;
+        }
+        corrupt = d->inStart < d->inEnd;
+    }
+#ifdef BF2C_WITH_ZLIB
+    if (d->format == INPUT_GZIP && !d->padding) {
+        if (d->frameEnded && inflateReset(&d->gz) != Z_OK) {
+            corrupt = 1;
+        }
+        uInt room = size > UINT_MAX ? UINT_MAX : (uInt)size;
+        d->gz.next_in = d->in + d->inStart;
+        d->gz.avail_in = (uInt)(d->inEnd - d->inStart);
+        d->gz.next_out = (Bytef *)out;
+        d->gz.avail_out = room;
+        int ret = corrupt ? Z_DATA_ERROR : inflate(&d->gz, Z_NO_FLUSH);
+        corrupt = ret != Z_OK && ret != Z_STREAM_END;
+        d->inStart = d->inEnd - d->gz.avail_in;
+        d->frameEnded = ret == Z_STREAM_END;
+        produced = room - d->gz.avail_out;
+    }
+#endif
+#ifdef BF2C_WITH_ZSTD
+    if (d->format == INPUT_ZSTD && !d->padding) {
+        ZSTD_inBuffer in = {d->in + d->inStart, d->inEnd - d->inStart, 0};
+        ZSTD_outBuffer result = {out, size, 0};
+        size_t ret = ZSTD_decompressStream(d->zstd, &result, &in);
+        corrupt = ZSTD_isError(ret);
+        d->inStart += in.pos;
+        d->frameEnded = ret == 0;
+        produced = result.pos;
+    }
+#endif
+    (void)out;
+    (void)size;
+    if (corrupt) {
+        fprintf(stderr, "Error: %s is not valid compressed data\n", d->name);
+        exit(EXIT_FAILURE);
+    }
+    return produced;
+}
+
+/*
+ * decode()
+ *
+ * Reads up to size bytes of the source from a decoder into out,
+ * decompressing them if needed. Returns the number of bytes read, which is
+ * 0 only at the end of the source.
+ */
+size_t decode(Decoder *d, char *out, size_t size) {
+    size_t n = 0;
+    if (d->format == INPUT_PLAIN) {
+        n = d->inEnd - d->inStart < size ? d->inEnd - d->inStart : size;
+        memcpy(out, d->in + d->inStart, n);
+        d->inStart += n;
+        n += fread(out + n, 1, size - n, d->fp);
+    }
+    while (d->format != INPUT_PLAIN && n == 0) {
+        if (d->inStart == d->inEnd) {
+            d->inStart = 0;
+            d->inEnd = fread(d->in, 1, SOURCE_BLOCK, d->fp);
+            if (d->inEnd == 0) {
+                if (!ferror(d->fp) && !d->frameEnded) {
+                    fprintf(stderr, "Error: %s is truncated\n", d->name);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+        }
+        n = inflate_block(d, out, size);
+    }
+    if (n == 0 && ferror(d->fp)) {
+        perror("Error reading input file");
         exit(EXIT_FAILURE);
     }
-    for (int i = 0; src[i] != '\0'; i++) {
+    return n;
+}
+
+/*
+ * close_decoder()
+ *
+ * Closes the input of a decoder and frees it.
+ */
+void close_decoder(Decoder *d) {
+#ifdef BF2C_WITH_ZLIB
+    if (d->format == INPUT_GZIP) {
+        inflateEnd(&d->gz);
+    }
+#endif
+#ifdef BF2C_WITH_ZSTD
+    if (d->format == INPUT_ZSTD) {
+        ZSTD_freeDStream(d->zstd);
+    }
+#endif
+    if (d->fp != stdin) {
+        fclose(d->fp);
+    }
+    free(d);
+}
+
+// State of the lexer: the tokens and bracket offsets found so far.
+typedef struct {
+    Token *tokens;
+    size_t count, capacity;
+    size_t *brackets;
+    size_t numBrackets, bracketCapacity;
+    size_t offset;      // Source offset of the next block
+} Lexer;
+
+/*
+ * lex_block()
+ *
+ * Adds the tokens of the next n bytes of the source to a lexer. A source
+ * can be lexed in as many blocks as it arrives in. Non-Brainfuck
+ * characters are ignored.
+ */
+void lex_block(Lexer *lexer, const char *src, size_t n) {
+    // The tokens are chars, which may alias anything, so the counts are
+    // kept in locals while the block is lexed.
+    Token *tokens = lexer->tokens;
+    size_t count = lexer->count, capacity = lexer->capacity;
+    for (size_t i = 0; i < n; i++) {
         char c = src[i];
         TokenType t;
         switch(c) {
@@ -93,12 +425,230 @@ Token* lex(const char* src, int *numTokens) {
                 exit(EXIT_FAILURE);
             }
         }
-        tokens[count].type = t;
-        tokens[count].pos = i;
+        if (t == TOKEN_LOOP_START || t == TOKEN_LOOP_END) {
+            if (lexer->numBrackets >= lexer->bracketCapacity) {
+                lexer->bracketCapacity *= 2;
+                lexer->brackets = realloc(lexer->brackets, lexer->bracketCapacity * sizeof(size_t));
+                if (!lexer->brackets) {
+                    perror("Memory reallocation failed in lex()");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            lexer->brackets[lexer->numBrackets++] = lexer->offset + i;
+        }
+        tokens[count].type = (unsigned char)t;
         count++;
     }
-    *numTokens = count;
-    return tokens;
+    lexer->tokens = tokens;
+    lexer->count = count;
+    lexer->capacity = capacity;
+    lexer->offset += n;
+}
+
+/*
+ * lex()
+ *
+ * Converts the Brainfuck source read from a decoder into a dynamic array
+ * of tokens, lexing it block by block as it is read or decompressed.
+ * If keep is nonzero, the source is also returned in *source as a
+ * NUL-terminated string; otherwise only its tokens are kept in memory.
+ *
+ * The number of tokens is returned in *numTokens, and the source offset of
+ * every '[' and ']', in order, in a new array in *brackets.
+ * The caller must free all three arrays.
+ */
+Token* lex(Decoder *d, int keep, char **source, size_t *numTokens, size_t **brackets) {
+    Lexer lexer = {NULL, 0, 128, NULL, 0, 16, 0};
+    size_t capacity = SOURCE_BLOCK, n;
+    char *text = malloc(capacity + 1);
+    lexer.tokens = malloc(lexer.capacity * sizeof(Token));
+    lexer.brackets = malloc(lexer.bracketCapacity * sizeof(size_t));
+    if (!text || !lexer.tokens || !lexer.brackets) {
+        perror("Memory allocation failed in lex()");
+        exit(EXIT_FAILURE);
+    }
+    while ((n = decode(d, keep ? text + lexer.offset : text, keep ? capacity - lexer.offset : capacity)) > 0) {
+        lex_block(&lexer, keep ? text + lexer.offset : text, n);
+        if (keep && lexer.offset == capacity) {
+            capacity *= 2;
+            text = realloc(text, capacity + 1);
+            if (!text) {
+                perror("Memory reallocation failed for source code");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (keep) {
+        text[lexer.offset] = '\0';
+        *source = text;
+    } else {
+        free(text);
+        *source = NULL;
+    }
+    *numTokens = lexer.count;
+    *brackets = lexer.brackets;
+    return lexer.tokens;
+}
+
+// A source, for the line and column of its positions. A compressed source
+// is not kept in memory, and is decompressed again when one is needed.
+typedef struct {
+    char *text;             // The whole source, or NULL if it was not kept
+    const char *path;       // File to read again if text is NULL
+} Source;
+
+// Decoder of the source that source_position() reads again, while open.
+Decoder *positionDecoder = NULL;
+
+/*
+ * close_source_positions()
+ *
+ * Closes the file source_position() reads positions from, if any.
+ */
+void close_source_positions(void) {
+    if (positionDecoder) {
+        close_decoder(positionDecoder);
+        positionDecoder = NULL;
+    }
+}
+
+/*
+ * source_position()
+ *
+ * Converts a source offset into a 1-based line and column. Positions are
+ * only needed for diagnostics, remarks and #line directives, so lines are
+ * counted on demand rather than tracked while lexing. memchr(), which C
+ * libraries vectorize, finds the newlines, and a call for an offset at or
+ * after that of the previous call on the same source resumes from there.
+ * A source that was not kept is read again block by block from its file,
+ * so for it too positions asked for in order cost one pass in total.
+ */
+void source_position(const Source *source, size_t offset, size_t *line, size_t *column) {
+    static const Source *lastSource;
+    static size_t lastOffset, lastLine, lastLineStart;
+    static char block[SOURCE_BLOCK];
+    static size_t blockStart, blockEnd;     // Source offsets held in block
+    if (source != lastSource || offset < lastOffset) {
+        lastSource = source;
+        lastOffset = lastLineStart = 0;
+        lastLine = 1;
+        close_source_positions();
+        if (!source->text && !(positionDecoder = open_decoder(source->path))) {
+            perror("Error opening input file");
+            exit(EXIT_FAILURE);
+        }
+        blockStart = blockEnd = 0;
+    }
+    while (lastOffset < offset) {
+        const char *data = source->text, *p, *end, *newline;
+        size_t dataStart = 0;
+        if (!data) {
+            if (lastOffset == blockEnd) {
+                blockStart = blockEnd;
+                blockEnd += positionDecoder ? decode(positionDecoder, block, SOURCE_BLOCK) : 0;
+                if (blockEnd == blockStart) {
+                    close_source_positions();
+                    break;
+                }
+            }
+            data = block;
+            dataStart = blockStart;
+        }
+        p = data + (lastOffset - dataStart);
+        end = data + ((!source->text && offset > blockEnd ? blockEnd : offset) - dataStart);
+        while ((newline = memchr(p, '\n', end - p)) != NULL) {
+            lastLine++;
+            lastLineStart = dataStart + (newline - data) + 1;
+            p = newline + 1;
+        }
+        lastOffset = dataStart + (end - data);
+    }
+    *line = lastLine;
+    *column = offset - lastLineStart + 1;
+}
+
+/*
+ * check_brackets()
+ *
+ * Checks that the brackets of a source read from a decoder are balanced,
+ * without building tokens or an AST, and prints an error naming the first
+ * bracket that is not. The input is read in blocks of CHECK_BLOCK bytes. A block
+ * whose closing brackets cannot bring the depth down to zero, which is
+ * most of them, is only counted, in loops the compiler vectorizes; the
+ * others are followed byte by byte. Returns nonzero if the brackets match.
+ */
+int check_brackets(Decoder *d, const char *path) {
+    static char block[CHECK_BLOCK];
+    size_t depth = 0, offset = 0, line = 1, lineStart = 0, n;
+    size_t openLine = 0, openColumn = 0;    // Last '[' opened at depth 0
+    while ((n = decode(d, block, CHECK_BLOCK)) > 0) {
+        size_t opens = 0, closes = 0, newlines = 0;
+        for (size_t i = 0; i < n; i++) {
+            opens += block[i] == '[';
+            closes += block[i] == ']';
+            newlines += block[i] == '\n';
+        }
+        if (depth > closes) {
+            depth += opens - closes;
+            line += newlines;
+            for (size_t i = n; newlines > 0 && i-- > 0;) {
+                if (block[i] == '\n') {
+                    lineStart = offset + i + 1;
+                    break;
+                }
+            }
+        } else {
+            for (size_t i = 0; i < n; i++) {
+                if (block[i] == '\n') {
+                    line++;
+                    lineStart = offset + i + 1;
+                } else if (block[i] == '[') {
+                    if (depth++ == 0) {
+                        openLine = line;
+                        openColumn = offset + i - lineStart + 1;
+                    }
+                } else if (block[i] == ']' && depth-- == 0) {
+                    fprintf(stderr, "%s: Error: Unmatched ']' at line %zu, column %zu\n",
+                            path, line, offset + i - lineStart + 1);
+                    return 0;
+                }
+            }
+        }
+        offset += n;
+    }
+    if (depth > 0) {
+        fprintf(stderr, "%s: Error: Unmatched '[' at line %zu, column %zu\n", path, openLine, openColumn);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * check_inputs()
+ *
+ * Runs check_brackets() on every input file, or on standard input if none
+ * is given, for --check. Returns the exit status: failure if any input has
+ * unbalanced brackets.
+ */
+int check_inputs(void) {
+    int ok = 1;
+    if (options.numStagePaths == 0) {
+        Decoder *d = open_decoder(NULL);
+        ok = check_brackets(d, "<stdin>");
+        close_decoder(d);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    for (int i = 0; i < options.numStagePaths; i++) {
+        Decoder *d = open_decoder(options.stagePaths[i]);
+        if (!d) {
+            perror(options.stagePaths[i]);
+            ok = 0;
+            continue;
+        }
+        ok &= check_brackets(d, options.stagePaths[i]);
+        close_decoder(d);
+    }
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 /*---------------------------------------------------------------
@@ -109,55 +659,78 @@ typedef struct ASTNode {
     int count;
     struct ASTNode *children;
     int numChildren;
+    int id;             // Loop number in source order (loops only)
+    size_t pos;         // Source offset of the '[' (loops only)
 } ASTNode;
 
+// State of the parser: the tokens and bracket offsets from the lexer, and
+// the next of each to read.
+typedef struct {
+    const Token *tokens;
+    size_t numTokens;
+    size_t index;
+    const size_t *brackets;
+    size_t bracket;
+    const Source *source;   // For the line and column of errors
+} Parser;
+
 /*
  * parseLevel()
  *
  * Recursively parses tokens into an AST for one "level" (the top level or inside a loop).
  *
  * Parameters:
- *   tokens     - The complete token array.
- *   numTokens  - Total number of tokens.
- *   index      - Pointer to the current index in the token array.
+ *   parser     - The tokens, bracket offsets and current indices into them.
  *   countOut   - Returns the number of AST nodes created at this level.
  *   insideLoop - If nonzero, the function expects to stop at a TOKEN_LOOP_END.
  *
  * On error (e.g. unmatched brackets), the function prints an error and exits.
+ * Runs longer than INT_MAX commands are split over several nodes, so that
+ * every count fits in an int.
  */
-ASTNode* parseLevel(Token* tokens, int numTokens, int *index, int *countOut, int insideLoop) {
-    int capacity = 10;
-    int count = 0;
+ASTNode* parseLevel(Parser *parser, int *countOut, int insideLoop) {
+    size_t capacity = 10;
+    size_t count = 0;
     ASTNode *nodes = malloc(capacity * sizeof(ASTNode));
     if (!nodes) {
         perror("Memory allocation failed in parseLevel()");
         exit(EXIT_FAILURE);
     }
     
-    while (*index < numTokens) {
-        Token current = tokens[*index];
+    while (parser->index < parser->numTokens) {
+        Token current = parser->tokens[parser->index];
         if (current.type == TOKEN_LOOP_END) {
             if (!insideLoop) {
-                fprintf(stderr, "Error: Unmatched ']' at position %d\n", current.pos);
+                size_t line, column;
+                source_position(parser->source, parser->brackets[parser->bracket], &line, &column);
+                fprintf(stderr, "Error: Unmatched ']' at line %zu, column %zu\n", line, column);
                 exit(EXIT_FAILURE);
             }
-            (*index)++; // TOKEN_LOOP_END
-            *countOut = count;
+            parser->index++; // TOKEN_LOOP_END
+            parser->bracket++;
+            *countOut = (int)count;
             return nodes;
         }
         
         if (current.type == TOKEN_LOOP_START) {
-            (*index)++; // TOKEN_LOOP_START
+            size_t pos = parser->brackets[parser->bracket++];
+            parser->index++; // TOKEN_LOOP_START
             int childCount = 0;
-            ASTNode *children = parseLevel(tokens, numTokens, index, &childCount, 1);
+            ASTNode *children = parseLevel(parser, &childCount, 1);
             
             ASTNode node;
             node.type = TOKEN_LOOP_START;
             node.count = 0;
             node.children = children;
             node.numChildren = childCount;
+            node.id = -1;
+            node.pos = pos;
             
             if (count >= capacity) {
+                if (count >= INT_MAX) {
+                    fprintf(stderr, "Error: More than %d commands at one nesting level\n", INT_MAX);
+                    exit(EXIT_FAILURE);
+                }
                 capacity *= 2;
                 nodes = realloc(nodes, capacity * sizeof(ASTNode));
                 if (!nodes) {
@@ -173,17 +746,24 @@ ASTNode* parseLevel(Token* tokens, int numTokens, int *index, int *countOut, int
             // Merge consecutive tokens of the same type.
             TokenType type = current.type;
             int repeat = 0;
-            while (*index < numTokens && tokens[*index].type == type) {
+            while (parser->index < parser->numTokens && parser->tokens[parser->index].type == type &&
+                   repeat < INT_MAX) {
                 repeat++;
-                (*index)++;
+                parser->index++;
             }
             ASTNode node;
             node.type = type;
             node.count = repeat;
             node.children = NULL;
             node.numChildren = 0;
+            node.id = -1;
+            node.pos = NO_POSITION;
             
             if (count >= capacity) {
+                if (count >= INT_MAX) {
+                    fprintf(stderr, "Error: More than %d commands at one nesting level\n", INT_MAX);
+                    exit(EXIT_FAILURE);
+                }
                 capacity *= 2;
                 nodes = realloc(nodes, capacity * sizeof(ASTNode));
                 if (!nodes) {
@@ -194,7 +774,7 @@ ASTNode* parseLevel(Token* tokens, int numTokens, int *index, int *countOut, int
             nodes[count++] = node;
         }
         else {
-            (*index)++;
+            parser->index++;
         }
     }
     
@@ -203,167 +783,4300 @@ ASTNode* parseLevel(Token* tokens, int numTokens, int *index, int *countOut, int
         exit(EXIT_FAILURE);
     }
     
-    *countOut = count;
+    *countOut = (int)count;
     return nodes;
 }
 
 /*
  * parseTokens()
  *
- * Entry point for parsing the entire token stream into an AST.
+ * Entry point for parsing the entire token stream into an AST, given the
+ * bracket offsets from lex() and the source for error positions.
  * Returns a pointer to an array of AST nodes representing the root level.
  * The number of nodes is returned in *countOut.
  */
-ASTNode* parseTokens(Token* tokens, int numTokens, int *countOut) {
-    int index = 0;
-    return parseLevel(tokens, numTokens, &index, countOut, 0);
+ASTNode* parseTokens(Token* tokens, size_t numTokens, const size_t *brackets, const Source *source,
+                     int *countOut) {
+    Parser parser = {tokens, numTokens, 0, brackets, 0, source};
+    return parseLevel(&parser, countOut, 0);
 }
 
-/*---------------------------------------------------------------
- * Generator Phase: Code Generation Functions
- *--------------------------------------------------------------*/
-void print_indent(int level) {
-    for (int i = 0; i < level; i++) {
-        printf("    ");
-    }
-}
+// One independently parsed program; a pipeline has several.
+typedef struct {
+    ASTNode *nodes;
+    int numNodes;
+    Source source;      // Kept for the source positions in remarks
+} Stage;
 
 /*
- * generate_code()
- *
- * Recursively traverses the AST and prints out equivalent C code.
+ * number_loops()
  *
- * Parameters:
- *   nodes        - Pointer to the current AST node array.
- *   numNodes     - Number of nodes at this level.
- *   indent_level - Current indentation level for pretty printing.
+ * Assigns every loop node a number in source (pre-order) order, starting at
+ * *next. The numbers identify loops in profiles and in the generated code.
  */
-void generate_code(ASTNode* nodes, int numNodes, int indent_level) {
+void number_loops(ASTNode* nodes, int numNodes, int *next) {
     for (int i = 0; i < numNodes; i++) {
-        ASTNode node = nodes[i];
-        switch (node.type) {
-            case TOKEN_PLUS:
-                print_indent(indent_level);
-                printf("*ptr += %d;\n", node.count);
-                break;
-            case TOKEN_MINUS:
-                print_indent(indent_level);
-                printf("*ptr -= %d;\n", node.count);
-                break;
-            case TOKEN_NEXT:
-                print_indent(indent_level);
-                printf("ptr += %d;\n", node.count);
-                break;
-            case TOKEN_PREVIOUS:
-                print_indent(indent_level);
-                printf("ptr -= %d;\n", node.count);
-                break;
-            case TOKEN_OUTPUT:
-                if (node.count == 1) {
-                    print_indent(indent_level);
-                    printf("putchar(*ptr);\n");
-                } else {
-                    print_indent(indent_level);
-                    printf("for (int i = 0; i < %d; i++) {\n", node.count);
-                    print_indent(indent_level + 1);
-                    printf("putchar(*ptr);\n");
-                    print_indent(indent_level);
-                    printf("}\n");
-                }
-                break;
-            case TOKEN_INPUT:
-                if (node.count == 1) {
-                    print_indent(indent_level);
-                    printf("*ptr = getchar();\n");
-                } else {
-                    print_indent(indent_level);
-                    printf("for (int i = 0; i < %d; i++) {\n", node.count);
-                    print_indent(indent_level + 1);
-                    printf("*ptr = getchar();\n");
-                    print_indent(indent_level);
-                    printf("}\n");
-                }
-                break;
-            case TOKEN_LOOP_START:
-                print_indent(indent_level);
-                printf("while (*ptr) {\n");
-                generate_code(node.children, node.numChildren, indent_level + 1);
-                print_indent(indent_level);
-                printf("}\n");
-                break;
-            default:
-                break;
+        if (nodes[i].type == TOKEN_LOOP_START) {
+            if (*next == INT_MAX) {
+                fprintf(stderr, "Error: More than %d loops\n", INT_MAX);
+                exit(EXIT_FAILURE);
+            }
+            nodes[i].id = (*next)++;
+            number_loops(nodes[i].children, nodes[i].numChildren, next);
         }
     }
 }
 
 /*
- * free_ast()
+ * ast_checksum()
  *
- * Recursively frees memory allocated for the AST.
+ * Computes a 32-bit FNV-1a hash over the shape of the AST. A profile is only
+ * applied to the program it was recorded from, so the hash is stored in the
+ * profile and compared when it is read back.
  */
-void free_ast(ASTNode* nodes, int numNodes) {
+unsigned long ast_checksum(ASTNode* nodes, int numNodes, unsigned long hash) {
     for (int i = 0; i < numNodes; i++) {
-        if (nodes[i].type == TOKEN_LOOP_START && nodes[i].children != NULL) {
-            free_ast(nodes[i].children, nodes[i].numChildren);
-            free(nodes[i].children);
+        hash = ((hash ^ (unsigned long)nodes[i].type) * 16777619UL) & 0xffffffffUL;
+        hash = ((hash ^ (unsigned long)nodes[i].count) * 16777619UL) & 0xffffffffUL;
+        if (nodes[i].type == TOKEN_LOOP_START) {
+            hash = ast_checksum(nodes[i].children, nodes[i].numChildren, hash);
+            hash = ((hash ^ (unsigned long)TOKEN_LOOP_END) * 16777619UL) & 0xffffffffUL;
         }
     }
+    return hash;
 }
 
 /*---------------------------------------------------------------
- * Main Function: Integrating Lexer, Parser, and Generator
+ * Profile Phase: Loop Profiles and Profile-Guided Decisions
  *--------------------------------------------------------------*/
-int main(int argc, char *argv[]) {
-    FILE *fp = stdin;
-    if (argc > 1) {
-        fp = fopen(argv[1], "r");
-        if (!fp) {
-            perror("Error opening input file");
-            exit(EXIT_FAILURE);
+
+// Per-loop execution counts and the decisions derived from them.
+typedef struct {
+    unsigned long long entries;     // Times the loop was reached
+    unsigned long long iterations;  // Times the loop body ran
+    unsigned long long *values;     // Histogram of the counter at entry, or NULL
+    int valueSlot;                  // Histogram index in instrumented builds, or -1
+    int hot;                        // Loop carries at least HOT_PERCENT of the weight
+    int outlined;                   // Never executed; emitted as a cold function
+    int nativeSlot;                 // Native function index in hybrid mode, or -1
+    int memoSlot;                   // Memo table index, or -1
+    int copyLoop;                   // Lowered to a bulk input-to-output copy
+    unsigned char *map;             // Output byte per input byte of a stream filter, or NULL
+    int mapStop;                    // Input byte that ends the stream filter
+    int mapLow, mapHigh;            // Scratch cells of the filter, relative to ptr
+    int memoLow, memoHigh;          // Cells the loop can touch, relative to ptr
+    int numSpecialized;             // Entry values with a fully unrolled copy
+    unsigned char *hoisted;         // Per child: part of a store moved before the loop, or NULL
+    int specialized[MAX_SPECIALIZED];
+} LoopInfo;
+
+#define HOT_PERCENT 1
+#define SPECIALIZE_PERCENT 25
+
+LoopInfo *loopInfo = NULL;  // Indexed by loop id
+int numLoops = 0;
+int numValueSlots = 0;
+int numMemoSlots = 0;
+int numNativeSlots = 0;
+int numCopyLoops = 0;
+int numTransformLoops = 0;
+int numResumePoints = 0;
+int haveProfile = 0;
+unsigned long programChecksum = 0;
+const Source *programSource = NULL;
+int loopDepth = 0;      // Loops open around the code being printed
+
+/*
+ * counted_loop_reason()
+ *
+ * Returns why a loop is not a plain counted loop, or NULL if it is one; the
+ * counter's step of 1 or -1 is then stored in *stepOut.
+ */
+const char* counted_loop_reason(ASTNode* node, int *stepOut) {
+    int offset = 0, step = 0;
+    for (int i = 0; i < node->numChildren; i++) {
+        ASTNode *child = &node->children[i];
+        switch (child->type) {
+            case TOKEN_PLUS:     if (offset == 0) step += child->count; break;
+            case TOKEN_MINUS:    if (offset == 0) step -= child->count; break;
+            case TOKEN_NEXT:     offset += child->count; break;
+            case TOKEN_PREVIOUS: offset -= child->count; break;
+            case TOKEN_OUTPUT:   break;
+            case TOKEN_INPUT:    return "input in body";
+            default:             return "nested loop";
         }
     }
-    
-    fseek(fp, 0, SEEK_END);
-    long fsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-    
-    char *source = malloc(fsize + 1);
-    if (!source) {
-        perror("Memory allocation failed for source code");
-        exit(EXIT_FAILURE);
+    if (offset != 0) {
+        return "unbalanced pointer";
+    }
+    step = ((step % 256) + 256) % 256;
+    if (step == 0) {
+        return "counter unchanged";
+    }
+    if (step % 2 == 0) {
+        return "counter step even";
+    }
+    if (step != 1 && step != 255) {
+        return "counter step not +1 or -1";
+    }
+    *stepOut = step == 1 ? 1 : -1;
+    return NULL;
+}
+
+/*
+ * counted_loop_step()
+ *
+ * Returns the amount a loop adds to its counter cell per iteration if the
+ * loop is a plain counted loop: no nested loops, no input, the pointer back
+ * where it started after each iteration, and the counter moving by one. Such
+ * a loop runs a number of times that follows from the counter's entry value.
+ * Returns 0 for any other loop.
+ */
+int counted_loop_step(ASTNode* node) {
+    int step;
+    return counted_loop_reason(node, &step) ? 0 : step;
+}
+
+/*
+ * counted_loop_trips()
+ *
+ * Returns the number of iterations a counted loop with the given step runs
+ * when it is entered with the counter at value.
+ */
+int counted_loop_trips(int step, int value) {
+    return step < 0 ? value : (256 - value) % 256;
+}
+
+/*
+ * assign_value_slots()
+ *
+ * Gives every counted loop a slot for its entry-value histogram in
+ * instrumented builds.
+ */
+void assign_value_slots(ASTNode* nodes, int numNodes) {
+    for (int i = 0; i < numNodes; i++) {
+        if (nodes[i].type == TOKEN_LOOP_START) {
+            loopInfo[nodes[i].id].valueSlot =
+                counted_loop_step(&nodes[i]) ? numValueSlots++ : -1;
+            assign_value_slots(nodes[i].children, nodes[i].numChildren);
+        }
+    }
+}
+
+/*
+ * load_profile()
+ *
+ * Reads a profile written by a --profile-generate build. Returns nonzero on
+ * success. A profile that cannot be read or that belongs to a different
+ * program is reported and ignored, so a stale profile never breaks a build.
+ */
+int load_profile(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror("Warning: cannot open profile");
+        return 0;
     }
-    fread(source, 1, fsize, fp);
-    source[fsize] = '\0';
-    if (fp != stdin) {
+
+    char magic[32];
+    int version = 0, loops = 0;
+    unsigned long checksum = 0;
+    if (fscanf(fp, "%31s %d checksum %lx loops %d", magic, &version, &checksum, &loops) != 4 ||
+        strcmp(magic, PROFILE_MAGIC) != 0 || version != PROFILE_VERSION) {
+        fprintf(stderr, "Warning: %s is not a bf2c profile; ignoring it\n", path);
         fclose(fp);
+        return 0;
+    }
+    if (checksum != programChecksum || loops != numLoops) {
+        fprintf(stderr, "Warning: %s was recorded for a different program; ignoring it\n", path);
+        fclose(fp);
+        return 0;
+    }
+
+    int id, value;
+    unsigned long long entries, iterations, hits;
+    while (fscanf(fp, " loop %d %llu %llu", &id, &entries, &iterations) == 3) {
+        if (id >= 0 && id < numLoops) {
+            loopInfo[id].entries = entries;
+            loopInfo[id].iterations = iterations;
+        }
+    }
+    while (fscanf(fp, " value %d %d %llu", &id, &value, &hits) == 3) {
+        if (id < 0 || id >= numLoops || value < 0 || value > 255) {
+            continue;
+        }
+        if (!loopInfo[id].values) {
+            loopInfo[id].values = calloc(256, sizeof(unsigned long long));
+            if (!loopInfo[id].values) {
+                perror("Memory allocation failed in load_profile()");
+                exit(EXIT_FAILURE);
+            }
+        }
+        loopInfo[id].values[value] = hits;
+    }
+    fclose(fp);
+    return 1;
+}
+
+/*
+ * mark_cold_loops()
+ *
+ * Marks the outermost loops that were never reached for outlining into cold
+ * functions. Loops nested inside an outlined loop stay inline in it.
+ */
+void mark_cold_loops(ASTNode* nodes, int numNodes) {
+    for (int i = 0; i < numNodes; i++) {
+        if (nodes[i].type != TOKEN_LOOP_START) {
+            continue;
+        }
+        if (loopInfo[nodes[i].id].entries == 0) {
+            loopInfo[nodes[i].id].outlined = 1;
+        } else {
+            mark_cold_loops(nodes[i].children, nodes[i].numChildren);
+        }
+    }
+}
+
+/*
+ * choose_specializations()
+ *
+ * Picks, for each hot counted loop, up to MAX_SPECIALIZED entry values that
+ * account for at least SPECIALIZE_PERCENT of its entries and lead to no more
+ * than UNROLL_LIMIT iterations. The generator emits a fully unrolled copy of
+ * the loop for each of them, which is charged to --opt-fuel as the
+ * operations it adds; once the budget runs out no more copies are made.
+ */
+long take_fuel(long want);
+void charge_fuel(long granted, long left);
+
+void choose_specializations(ASTNode* nodes, int numNodes) {
+    for (int i = 0; i < numNodes; i++) {
+        if (nodes[i].type != TOKEN_LOOP_START) {
+            continue;
+        }
+        LoopInfo *info = &loopInfo[nodes[i].id];
+        int step = counted_loop_step(&nodes[i]);
+        if (info->hot && info->values && step) {
+            for (int v = 1; v < 256 && info->numSpecialized < MAX_SPECIALIZED; v++) {
+                long cost = (long)counted_loop_trips(step, v) * nodes[i].numChildren;
+                if (info->values[v] * 100 >= info->entries * SPECIALIZE_PERCENT &&
+                    counted_loop_trips(step, v) <= UNROLL_LIMIT && take_fuel(cost) >= cost) {
+                    charge_fuel(cost, 0);
+                    info->specialized[info->numSpecialized++] = v;
+                }
+            }
+        }
+        choose_specializations(nodes[i].children, nodes[i].numChildren);
+    }
+}
+
+/*
+ * apply_profile()
+ *
+ * Classifies loops as hot or cold. A loop's weight is the number of times its
+ * condition was evaluated; loops carrying at least HOT_PERCENT of the total
+ * weight are hot.
+ */
+void apply_profile(ASTNode* ast, int numNodes) {
+    unsigned long long total = 0;
+    for (int i = 0; i < numLoops; i++) {
+        total += loopInfo[i].entries + loopInfo[i].iterations;
+    }
+    for (int i = 0; i < numLoops; i++) {
+        unsigned long long weight = loopInfo[i].entries + loopInfo[i].iterations;
+        loopInfo[i].hot = weight > 0 && weight * 100 >= total * HOT_PERCENT;
+    }
+    if (!options.resumable && !options.checkpoint) {
+        // A resume point cannot be reached inside an outlined function.
+        mark_cold_loops(ast, numNodes);
+    }
+    choose_specializations(ast, numNodes);
+}
+
+/*---------------------------------------------------------------
+ * Optimizer Phase: Loop Analyses
+ *--------------------------------------------------------------*/
+
+// Optimization budgets: the evaluation steps left under --opt-fuel, and
+// the time at which the --opt-budget-ms budget runs out.
+long long optFuelLeft = 0;
+struct timespec optDeadline;
+
+/*
+ * start_opt_budget()
+ *
+ * Starts the optimization budgets. Called before the Profile Phase, whose
+ * specialized copies draw on them too.
+ */
+void start_opt_budget(void) {
+    optFuelLeft = options.optFuel;
+    if (options.optBudgetMs > 0) {
+        timespec_get(&optDeadline, TIME_UTC);
+        optDeadline.tv_sec += (time_t)(options.optBudgetMs / 1000);
+        optDeadline.tv_nsec += (long)(options.optBudgetMs % 1000) * 1000000L;
+        if (optDeadline.tv_nsec >= 1000000000L) {
+            optDeadline.tv_sec++;
+            optDeadline.tv_nsec -= 1000000000L;
+        }
+    }
+}
+
+/*
+ * opt_budget_spent()
+ *
+ * Returns nonzero once the fuel or the time budget has run out.
+ */
+int opt_budget_spent(void) {
+    struct timespec now;
+    if (options.optFuel > 0 && optFuelLeft <= 0) {
+        return 1;
+    }
+    if (options.optBudgetMs == 0) {
+        return 0;
+    }
+    timespec_get(&now, TIME_UTC);
+    return now.tv_sec > optDeadline.tv_sec ||
+           (now.tv_sec == optDeadline.tv_sec && now.tv_nsec >= optDeadline.tv_nsec);
+}
+
+/*
+ * take_fuel()
+ *
+ * Returns the fuel granted to an evaluation that would like want steps:
+ * less if --opt-fuel has less left, and none once a budget has run out, so
+ * that the analysis gives up and its loop stays as it is.
+ */
+long take_fuel(long want) {
+    if (opt_budget_spent()) {
+        return 0;
+    }
+    return options.optFuel > 0 && want > optFuelLeft ? (long)optFuelLeft : want;
+}
+
+/*
+ * charge_fuel()
+ *
+ * Charges the steps an evaluation used, out of the fuel it was granted,
+ * to --opt-fuel.
+ */
+void charge_fuel(long granted, long left) {
+    if (options.optFuel > 0) {
+        optFuelLeft -= granted - (left > 0 ? left : 0);
+    }
+}
+
+/*
+ * pure_block_window()
+ *
+ * Checks that a sequence of nodes performs no I/O and that it and every loop
+ * in it leave the pointer where they found it. The cells such code can touch
+ * are then fixed relative to the pointer; their range is merged into *low and
+ * *high. Returns nonzero if the code qualifies.
+ */
+int pure_block_window(ASTNode* nodes, int numNodes, int *low, int *high) {
+    int offset = 0;
+    for (int i = 0; i < numNodes; i++) {
+        ASTNode *child = &nodes[i];
+        switch (child->type) {
+            case TOKEN_PLUS:
+            case TOKEN_MINUS:
+                break;
+            case TOKEN_NEXT:
+                offset += child->count;
+                break;
+            case TOKEN_PREVIOUS:
+                offset -= child->count;
+                break;
+            case TOKEN_LOOP_START:
+            case TOKEN_WIDE_ADD: {
+                int innerLow = 0, innerHigh = 0;
+                if (!pure_block_window(child->children, child->numChildren, &innerLow, &innerHigh)) {
+                    return 0;
+                }
+                if (offset + innerLow < *low) *low = offset + innerLow;
+                if (offset + innerHigh > *high) *high = offset + innerHigh;
+                break;
+            }
+            default:
+                return 0;
+        }
+        if (offset < *low) *low = offset;
+        if (offset > *high) *high = offset;
+    }
+    return offset == 0;
+}
+
+/*
+ * pure_loop_window()
+ *
+ * Applies pure_block_window() to the body of a loop.
+ */
+int pure_loop_window(ASTNode* node, int *low, int *high) {
+    return pure_block_window(node->children, node->numChildren, low, high);
+}
+
+/*
+ * eval_counted_loop()
+ *
+ * Runs a counted loop in one pass over its body, adding each change times
+ * the number of iterations. Returns 0 if the loop would leave the window or
+ * write output.
+ */
+int eval_counted_loop(ASTNode* node, int step, unsigned char *cells, int size, int pos) {
+    int trips = counted_loop_trips(step, cells[pos]), offset = 0;
+    if (trips == 0) {
+        return 1;
+    }
+    for (int i = 0; i < node->numChildren; i++) {
+        ASTNode *child = &node->children[i];
+        switch (child->type) {
+            case TOKEN_NEXT:     offset += child->count; break;
+            case TOKEN_PREVIOUS: offset -= child->count; break;
+            case TOKEN_OUTPUT:   return 0;
+            default:             break;
+        }
+        if (pos + offset < 0 || pos + offset >= size) {
+            return 0;
+        }
+        if (offset != 0 && child->type == TOKEN_PLUS) {
+            cells[pos + offset] += trips * (child->count % 256);
+        } else if (offset != 0 && child->type == TOKEN_MINUS) {
+            cells[pos + offset] -= trips * (child->count % 256);
+        }
+    }
+    cells[pos] = 0;
+    return 1;
+}
+
+/*
+ * eval_block()
+ *
+ * Runs I/O-free nodes at transpile time on a window of cells, with *pos the
+ * current index into it. Each node executed costs one unit of *fuel, and a
+ * counted loop runs in one pass over its body. Returns 0 if the code
+ * performs I/O, leaves the window or runs out of fuel; the window contents
+ * are then unspecified.
+ */
+int eval_block(ASTNode* nodes, int numNodes, unsigned char *cells, int size, int *pos, long *fuel) {
+    for (int i = 0; i < numNodes; i++) {
+        int step;
+        if (--*fuel < 0) {
+            return 0;
+        }
+        switch (nodes[i].type) {
+            case TOKEN_PLUS:     cells[*pos] += nodes[i].count; break;
+            case TOKEN_MINUS:    cells[*pos] -= nodes[i].count; break;
+            case TOKEN_NEXT:     *pos += nodes[i].count; break;
+            case TOKEN_PREVIOUS: *pos -= nodes[i].count; break;
+            case TOKEN_LOOP_START:
+                step = counted_loop_step(&nodes[i]);
+                if (step != 0) {
+                    *fuel -= nodes[i].numChildren;
+                    if (!eval_counted_loop(&nodes[i], step, cells, size, *pos)) {
+                        return 0;
+                    }
+                    break;
+                }
+                while (cells[*pos]) {
+                    if (!eval_block(nodes[i].children, nodes[i].numChildren, cells, size, pos, fuel)) {
+                        return 0;
+                    }
+                }
+                break;
+            case TOKEN_WIDE_ADD:
+                if (!eval_block(nodes[i].children, nodes[i].numChildren, cells, size, pos, fuel)) {
+                    return 0;
+                }
+                break;
+            default:
+                return 0;
+        }
+        if (*pos < 0 || *pos >= size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * loop_adjust()
+ *
+ * Returns the net amount added to the current cell by the nodes in
+ * [first, last), or -1 unless they are all '+' and '-'.
+ */
+int loop_adjust(ASTNode* nodes, int first, int last) {
+    int adjust = 0;
+    for (int i = first; i < last; i++) {
+        if (nodes[i].type == TOKEN_PLUS) {
+            adjust += nodes[i].count;
+        } else if (nodes[i].type == TOKEN_MINUS) {
+            adjust -= nodes[i].count;
+        } else {
+            return -1;
+        }
+    }
+    return ((adjust % 256) + 256) % 256;
+}
+
+/*
+ * copy_loop_shape()
+ *
+ * Recognizes the copy loop of the cat idiom, "[q.,p]" where q and p are
+ * runs of '+' and '-' that cancel out, as in ",[.,]" or ",+[-.,+]". Every
+ * byte read is written back unchanged until the byte that makes the cell
+ * zero after adding p. On a match the adjustments are returned in *before
+ * and *after.
+ */
+int copy_loop_shape(ASTNode* node, int *before, int *after) {
+    ASTNode *body = node->children;
+    int n = node->numChildren, out = -1;
+    for (int i = 0; i + 1 < n; i++) {
+        if (body[i].type == TOKEN_OUTPUT && body[i + 1].type == TOKEN_INPUT) {
+            out = i;
+            break;
+        }
+    }
+    if (out < 0 || body[out].count != 1 || body[out + 1].count != 1) {
+        return 0;
+    }
+    *before = loop_adjust(body, 0, out);
+    *after = loop_adjust(body, out + 2, n);
+    return *before >= 0 && *after >= 0 && (*before + *after) % 256 == 0;
+}
+
+/*
+ * transform_loop_table()
+ *
+ * Recognizes stream filters "[T.,p]" where T is pure code over a window of
+ * at most MEMO_WINDOW cells that leaves every cell but the current one as
+ * zero, provided they were zero before. Each output byte is then a function
+ * of the byte read, which is tabulated by running T at transpile time for
+ * every input value. On a match the table is stored in *map, indexed by
+ * input byte, and the byte that ends the loop in *stop.
+ */
+int transform_loop_table(ASTNode* node, unsigned char **map, int *stop, int *low, int *high) {
+    ASTNode *body = node->children;
+    int n = node->numChildren, out = n - 2, after = 0;
+    while (out >= 0 && (body[out + 1].type == TOKEN_PLUS || body[out + 1].type == TOKEN_MINUS)) {
+        out--;
+    }
+    if (out < 0 || body[out].type != TOKEN_OUTPUT || body[out + 1].type != TOKEN_INPUT ||
+        body[out].count != 1 || body[out + 1].count != 1) {
+        return 0;
+    }
+    after = loop_adjust(body, out + 2, n);
+    *low = *high = 0;
+    if (!pure_block_window(body, out, low, high) || *high - *low + 1 > MEMO_WINDOW) {
+        return 0;
+    }
+
+    int size = *high - *low + 1;
+    unsigned char *table = calloc(256, 1);
+    if (!table) {
+        perror("Memory allocation failed in transform_loop_table()");
+        exit(EXIT_FAILURE);
+    }
+    *stop = (256 - after) % 256;
+    for (int byte = 0; byte < 256; byte++) {
+        unsigned char cells[MEMO_WINDOW] = {0};
+        int pos = -*low, ok = 1;
+        long fuel, granted;
+        if (byte == *stop) {
+            continue;
+        }
+        cells[pos] = (unsigned char)(byte + after);
+        fuel = granted = take_fuel(TRANSFORM_FUEL);
+        ok = eval_block(body, out, cells, size, &pos, &fuel) && pos == -*low;
+        charge_fuel(granted, fuel);
+        for (int c = 0; ok && c < size; c++) {
+            ok = c == pos || cells[c] == 0;
+        }
+        if (!ok) {
+            free(table);
+            return 0;
+        }
+        table[byte] = cells[pos];
+    }
+    *map = table;
+    return 1;
+}
+
+/*
+ * map_is_affine()
+ *
+ * Returns k if a stream filter table adds the constant k to every byte, so
+ * that the filter can run as a vectorizable addition, or -1 otherwise.
+ */
+int map_is_affine(const unsigned char *map, int stop) {
+    int add = (map[stop == 0 ? 1 : 0] - (stop == 0 ? 1 : 0) + 256) % 256;
+    for (int byte = 0; byte < 256; byte++) {
+        if (byte != stop && map[byte] != (unsigned char)(byte + add)) {
+            return -1;
+        }
+    }
+    return add;
+}
+
+/*
+ * mark_copy_loops()
+ *
+ * Flags every copy loop so that the generator lowers it to bf_copy_until(),
+ * and tabulates every other stream filter for bf_transform_until(), adding
+ * the loops found to the two counts.
+ */
+void mark_copy_loops(ASTNode* nodes, int numNodes, int *copyLoops, int *transformLoops) {
+    for (int i = 0; i < numNodes; i++) {
+        if (nodes[i].type != TOKEN_LOOP_START) {
+            continue;
+        }
+        LoopInfo *info = &loopInfo[nodes[i].id];
+        int before, after;
+        if (info->outlined) {
+            continue;
+        }
+        if (copy_loop_shape(&nodes[i], &before, &after)) {
+            info->copyLoop = 1;
+            (*copyLoops)++;
+        } else if (transform_loop_table(&nodes[i], &info->map, &info->mapStop,
+                                        &info->mapLow, &info->mapHigh)) {
+            (*transformLoops)++;
+        } else {
+            mark_copy_loops(nodes[i].children, nodes[i].numChildren, copyLoops, transformLoops);
+        }
+    }
+}
+
+/*
+ * tree_size()
+ *
+ * Returns the number of nodes in a sequence, counting nested ones.
+ */
+long tree_size(ASTNode* nodes, int numNodes) {
+    long size = numNodes;
+    for (int i = 0; i < numNodes; i++) {
+        size += tree_size(nodes[i].children, nodes[i].numChildren);
+    }
+    return size;
+}
+
+/*
+ * assign_memo_slots()
+ *
+ * Picks the loops whose effect is cached at run time with --memoize: the
+ * outermost pure loops with a window of at most MEMO_WINDOW cells that
+ * contain a nested loop. Loops without one are too cheap to be worth a
+ * lookup. Each loop considered is charged to --opt-fuel as the nodes the
+ * window analysis walks; once the budget runs out no more loops are
+ * memoized.
+ */
+void assign_memo_slots(ASTNode* nodes, int numNodes) {
+    for (int i = 0; i < numNodes; i++) {
+        if (nodes[i].type != TOKEN_LOOP_START) {
+            continue;
+        }
+        LoopInfo *info = &loopInfo[nodes[i].id];
+        long cost = tree_size(nodes[i].children, nodes[i].numChildren);
+        if (take_fuel(cost) < cost) {
+            return;
+        }
+        charge_fuel(cost, 0);
+        int low = 0, high = 0, nested = 0;
+        for (int j = 0; j < nodes[i].numChildren; j++) {
+            nested |= nodes[i].children[j].type == TOKEN_LOOP_START;
+        }
+        if (nested && !info->outlined && pure_loop_window(&nodes[i], &low, &high) &&
+            high - low + 1 <= MEMO_WINDOW) {
+            info->memoSlot = numMemoSlots++;
+            info->memoLow = low;
+            info->memoHigh = high;
+        } else {
+            assign_memo_slots(nodes[i].children, nodes[i].numChildren);
+        }
+    }
+}
+
+// A run of sibling nodes that adds a constant to the 16-bit number held in
+// two cells, using the other cells of its window as scratch. Offsets are
+// relative to the pointer where the run starts and ends.
+typedef struct {
+    int lowCell, highCell;          // Little end and big end of the number
+    int windowLow, windowHigh;      // Every cell the pointer visits
+    unsigned scratch;               // Bit c set if cell windowLow + c is scratch
+    int add;                        // Constant added, modulo 65536
+    ASTNode *nodes;                 // The run itself, to reuse the result for copies
+    int numNodes;
+    unsigned long shape;            // ast_checksum() of the run
+} WideOp;
+
+WideOp *wideOps;
+int numWideOps;
+#if OPT_THREADS
+// Guards wideOps while the subtrees of --jobs fold their own additions.
+pthread_mutex_t wideLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * same_code()
+ *
+ * Returns nonzero if two node sequences are identical.
+ */
+int same_code(ASTNode* a, int numA, ASTNode* b, int numB) {
+    if (numA != numB) {
+        return 0;
+    }
+    for (int i = 0; i < numA; i++) {
+        if (a[i].type != b[i].type || a[i].count != b[i].count ||
+            !same_code(a[i].children, a[i].numChildren, b[i].children, b[i].numChildren)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * touched_cells()
+ *
+ * Sets bit c of *mask for every cell, c places right of the window's first
+ * cell, that pure nodes starting at that cell + offset add to or test.
+ * Cells the pointer only passes over are left out.
+ */
+void touched_cells(ASTNode* nodes, int numNodes, int offset, unsigned *mask) {
+    for (int i = 0; i < numNodes; i++) {
+        switch (nodes[i].type) {
+            case TOKEN_NEXT:
+                offset += nodes[i].count;
+                break;
+            case TOKEN_PREVIOUS:
+                offset -= nodes[i].count;
+                break;
+            case TOKEN_LOOP_START:
+            case TOKEN_WIDE_ADD:
+                touched_cells(nodes[i].children, nodes[i].numChildren, offset, mask);
+                *mask |= 1u << offset;
+                break;
+            default:
+                *mask |= 1u << offset;
+                break;
+        }
+    }
+}
+
+/*
+ * wide_add_result()
+ *
+ * Runs the nodes with x in cell a and y in cell b of a zeroed window. On
+ * success, returns 1 with the two cells in *x and *y, provided the code
+ * ended where it started and left every other cell zero.
+ */
+int wide_add_result(ASTNode* nodes, int numNodes, int low, int size, int a, int b,
+                    int *x, int *y, long *fuel) {
+    unsigned char cells[WIDE_WINDOW] = {0};
+    int pos = -low;
+    cells[a] = (unsigned char)*x;
+    cells[b] = (unsigned char)*y;
+    if (!eval_block(nodes, numNodes, cells, size, &pos, fuel) || pos != -low) {
+        return 0;
+    }
+    for (int c = 0; c < size; c++) {
+        if (c != a && c != b && cells[c]) {
+            return 0;
+        }
+    }
+    *x = cells[a];
+    *y = cells[b];
+    return 1;
+}
+
+/*
+ * wide_add_holds()
+ *
+ * Checks that the nodes add k to the number with its little end in cell lo
+ * and its big end in cell hi, for every (x, y) pair given, or for all 65536
+ * of them if numPairs is 0, in at most maxFuel steps. The time budget is
+ * checked as it goes, since the exhaustive check can take a while.
+ */
+int wide_add_holds(ASTNode* nodes, int numNodes, int low, int size, int lo, int hi,
+                   long k, const unsigned char *pairs, int numPairs, long maxFuel) {
+    int total = numPairs ? numPairs : 65536, holds = 1;
+    long fuel = take_fuel(maxFuel), granted = fuel;
+    for (int p = 0; p < total && holds; p++) {
+        int x = numPairs ? pairs[2 * p] : p & 255;
+        int y = numPairs ? pairs[2 * p + 1] : p >> 8;
+        long sum = (x + 256L * y + k) & 0xffff;
+        holds = (p % 4096 != 4095 || !opt_budget_spent()) &&
+                wide_add_result(nodes, numNodes, low, size, lo, hi, &x, &y, &fuel) &&
+                x + 256L * y == sum;
+    }
+    charge_fuel(granted, fuel);
+    return holds;
+}
+
+/*
+ * match_wide_add()
+ *
+ * Checks whether pure, balanced nodes over the window [low, high] add a
+ * constant to a 16-bit number held in two of its cells, with the rest of
+ * the window as scratch cells that start and end zero. Candidates are
+ * screened on a few values around the carry boundaries and then verified
+ * exhaustively. On a match the operation is stored in *op.
+ */
+int match_wide_add(ASTNode* nodes, int numNodes, int low, int high, WideOp *op) {
+    static const unsigned char edges[] = {0, 1, 2, 127, 128, 254, 255};
+    unsigned char pairs[2 * 49];
+    int size = high - low + 1, numPairs = 0;
+    unsigned touched = 0;
+    touched_cells(nodes, numNodes, -low, &touched);
+    for (int i = 0; i < 7; i++) {
+        for (int j = 0; j < 7; j++) {
+            pairs[numPairs * 2] = edges[i];
+            pairs[numPairs++ * 2 + 1] = edges[j];
+        }
+    }
+    for (int a = 0; a < size; a++) {
+        for (int b = a + 1; b < size; b++) {
+            int x = 0, y = 0, ran;
+            long fuel, granted;
+            if (!(touched >> a & touched >> b & 1)) {
+                continue;
+            }
+            fuel = granted = take_fuel(WIDE_SAMPLE_FUEL);
+            ran = wide_add_result(nodes, numNodes, low, size, a, b, &x, &y, &fuel);
+            charge_fuel(granted, fuel);
+            if (!ran) {
+                continue;
+            }
+            // Try both byte orders; the start value 0 gives the constant.
+            for (int order = 0; order < 2; order++) {
+                int lo = order ? b : a, hi = order ? a : b;
+                long k = order ? y + 256L * x : x + 256L * y;
+                if (k % 256 == 0 ||
+                    !wide_add_holds(nodes, numNodes, low, size, lo, hi, k, pairs, numPairs,
+                                    WIDE_SAMPLE_FUEL * numPairs) ||
+                    !wide_add_holds(nodes, numNodes, low, size, lo, hi, k, NULL, 0, WIDE_FUEL)) {
+                    continue;
+                }
+                op->lowCell = lo + low;
+                op->highCell = hi + low;
+                op->windowLow = low;
+                op->windowHigh = high;
+                op->scratch = touched & ~(1u << a) & ~(1u << b);
+                op->add = (int)k;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+ * find_wide_op()
+ *
+ * Looks for an identical run folded earlier and copies its operation to
+ * *op. Programs repeat their arithmetic, and verifying a run is costly.
+ */
+int find_wide_op(ASTNode* nodes, int numNodes, unsigned long shape, WideOp *op) {
+    int known = 0;
+#if OPT_THREADS
+    pthread_mutex_lock(&wideLock);
+#endif
+    for (int w = 0; w < numWideOps && !known; w++) {
+        if (wideOps[w].shape == shape && same_code(wideOps[w].nodes, wideOps[w].numNodes, nodes, numNodes)) {
+            *op = wideOps[w];
+            known = 1;
+        }
+    }
+#if OPT_THREADS
+    pthread_mutex_unlock(&wideLock);
+#endif
+    return known;
+}
+
+/*
+ * add_wide_op()
+ *
+ * Stores a folded run's operation and returns its index in wideOps.
+ */
+int add_wide_op(const WideOp *op) {
+    int id;
+#if OPT_THREADS
+    pthread_mutex_lock(&wideLock);
+#endif
+    wideOps = realloc(wideOps, (numWideOps + 1) * sizeof(WideOp));
+    if (!wideOps) {
+        perror("Memory allocation failed in add_wide_op()");
+        exit(EXIT_FAILURE);
+    }
+    wideOps[numWideOps] = *op;
+    id = numWideOps++;
+#if OPT_THREADS
+    pthread_mutex_unlock(&wideLock);
+#endif
+    return id;
+}
+
+/*
+ * fold_wide_adds()
+ *
+ * Replaces each run of sibling nodes that performs a multi-cell addition,
+ * such as a 16-bit increment that propagates its carry through scratch
+ * cells, with a TOKEN_WIDE_ADD node. The run must contain a loop, since
+ * straight-line code is already cheap, and the longest run from each
+ * starting node wins. The original nodes become the new node's children.
+ * With nested set, the bodies of the loops that are not folded are
+ * searched too; run_loop_passes() searches those of top-level loops in
+ * parallel once the top level has been folded.
+ */
+void fold_wide_adds(ASTNode* nodes, int *numNodes, int nested) {
+    for (int i = 0; i < *numNodes; i++) {
+        int offset = 0, low = 0, high = 0, loops = 0, end = -1;
+        int ends[WIDE_SPAN + 1], endLow[WIDE_SPAN + 1], endHigh[WIDE_SPAN + 1];
+        WideOp op;
+
+        // Collect the balanced runs starting at i that fit in the window.
+        for (int j = i; j < *numNodes && j - i < WIDE_SPAN; j++) {
+            int innerLow = 0, innerHigh = 0, pure = 1;
+            switch (nodes[j].type) {
+                case TOKEN_PLUS:
+                case TOKEN_MINUS:
+                    break;
+                case TOKEN_NEXT:
+                    offset += nodes[j].count;
+                    break;
+                case TOKEN_PREVIOUS:
+                    offset -= nodes[j].count;
+                    break;
+                case TOKEN_LOOP_START:
+                case TOKEN_WIDE_ADD:
+                    pure = pure_block_window(nodes[j].children, nodes[j].numChildren, &innerLow, &innerHigh);
+                    loops = 1;
+                    break;
+                default:
+                    pure = 0;
+                    break;
+            }
+            if (offset + innerLow < low) low = offset + innerLow;
+            if (offset + innerHigh > high) high = offset + innerHigh;
+            if (!pure || high - low + 1 > WIDE_WINDOW) {
+                break;
+            }
+            if (offset == 0 && loops) {
+                ends[++end] = j + 1;
+                endLow[end] = low;
+                endHigh[end] = high;
+            }
+        }
+        for (; end >= 0; end--) {
+            int length = ends[end] - i;
+            unsigned long shape = ast_checksum(&nodes[i], length, 2166136261UL);
+            if (find_wide_op(&nodes[i], length, shape, &op) ||
+                match_wide_add(&nodes[i], length, endLow[end], endHigh[end], &op)) {
+                op.shape = shape;
+                break;
+            }
+        }
+        if (end >= 0) {
+            int length = ends[end] - i;
+            ASTNode *children = malloc(length * sizeof(ASTNode));
+            if (!children) {
+                perror("Memory allocation failed in fold_wide_adds()");
+                exit(EXIT_FAILURE);
+            }
+            memcpy(children, &nodes[i], length * sizeof(ASTNode));
+            op.nodes = children;
+            op.numNodes = length;
+            nodes[i].type = TOKEN_WIDE_ADD;
+            nodes[i].count = op.add;
+            nodes[i].children = children;
+            nodes[i].numChildren = length;
+            nodes[i].id = add_wide_op(&op);
+            memmove(&nodes[i + 1], &nodes[i + length], (*numNodes - i - length) * sizeof(ASTNode));
+            *numNodes -= length - 1;
+        } else if (nested && nodes[i].type == TOKEN_LOOP_START) {
+            fold_wide_adds(nodes[i].children, &nodes[i].numChildren, 1);
+        }
+    }
+}
+
+/*
+ * is_clear_loop()
+ *
+ * Returns nonzero for a loop such as "[-]" that always ends with its cell
+ * zero: its body only adds an odd amount to the cell.
+ */
+int is_clear_loop(ASTNode* node) {
+    return node->type == TOKEN_LOOP_START && node->numChildren == 1 &&
+           (node->children[0].type == TOKEN_PLUS || node->children[0].type == TOKEN_MINUS) &&
+           node->children[0].count % 2 == 1;
+}
+
+/*
+ * cell_accesses()
+ *
+ * Counts the nodes that add to, test, read or write the cell at the given
+ * offset, with the nodes starting at *offset and *offset updated to where
+ * they end. Returns -1 if a nested loop does not leave the pointer where it
+ * found it, since the cells it reaches are then unknown.
+ */
+int cell_accesses(ASTNode* nodes, int numNodes, int cell, int *offset) {
+    int accesses = 0;
+    for (int i = 0; i < numNodes; i++) {
+        switch (nodes[i].type) {
+            case TOKEN_NEXT:
+                *offset += nodes[i].count;
+                break;
+            case TOKEN_PREVIOUS:
+                *offset -= nodes[i].count;
+                break;
+            case TOKEN_LOOP_START:
+            case TOKEN_WIDE_ADD: {
+                int inner = *offset;
+                int nested = cell_accesses(nodes[i].children, nodes[i].numChildren, cell, &inner);
+                if (nested < 0 || inner != *offset) {
+                    return -1;
+                }
+                accesses += nested + (*offset == cell);
+                break;
+            }
+            default:
+                accesses += *offset == cell;
+                break;
+        }
+    }
+    return accesses;
+}
+
+/*
+ * hoist_invariant_stores()
+ *
+ * Finds constant stores such as "[-]+" in loop bodies that are redundant
+ * after the first iteration: the body leaves the pointer where it started,
+ * and nothing else in it, nor the loop test, uses the stored cell. Such a
+ * store is marked in the loop's hoisted flags and emitted once before the
+ * loop instead.
+ */
+void hoist_invariant_stores(ASTNode* nodes, int numNodes) {
+    for (int i = 0; i < numNodes; i++) {
+        if (nodes[i].type != TOKEN_LOOP_START && nodes[i].type != TOKEN_WIDE_ADD) {
+            continue;
+        }
+        ASTNode *body = nodes[i].children;
+        int numBody = nodes[i].numChildren, offset = 0;
+        hoist_invariant_stores(body, numBody);
+        if (nodes[i].type != TOKEN_LOOP_START || cell_accesses(body, numBody, 0, &offset) < 0 ||
+            offset != 0) {
+            continue;
+        }
+        for (int j = 0; j < numBody; j++) {
+            if (body[j].type == TOKEN_NEXT) {
+                offset += body[j].count;
+            } else if (body[j].type == TOKEN_PREVIOUS) {
+                offset -= body[j].count;
+            } else if (offset != 0 && is_clear_loop(&body[j])) {
+                int length = j + 1 < numBody && loop_adjust(body, j + 1, j + 2) >= 0 ? 2 : 1;
+                int all = 0, store = offset;
+                if (cell_accesses(body, numBody, offset, &all) !=
+                    cell_accesses(&body[j], length, offset, &store)) {
+                    continue;
+                }
+                LoopInfo *info = &loopInfo[nodes[i].id];
+                if (!info->hoisted) {
+                    info->hoisted = calloc(numBody, 1);
+                    if (!info->hoisted) {
+                        perror("Memory allocation failed in hoist_invariant_stores()");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                memset(info->hoisted + j, 1, length);
+                j += length - 1;
+            }
+        }
+    }
+}
+
+// A top-level loop whose subtree the loop-local passes analyze, and the
+// loops they found in it.
+typedef struct {
+    ASTNode *node;
+    int markCopies;         // Also look for copy and transform loops
+    int copyLoops;
+    int transformLoops;
+} SubtreeTask;
+
+// The tasks of a parallel pass, handed out in order to the workers.
+typedef struct {
+    SubtreeTask *tasks;
+    int numTasks;
+    int next;
+#if OPT_THREADS
+    pthread_mutex_t lock;
+#endif
+} TaskQueue;
+
+/*
+ * run_subtree_task()
+ *
+ * Runs the passes that only look inside one loop on a top-level subtree:
+ * folding the 16-bit additions in its body, hoisting stores and matching
+ * copy and transform loops. They write nothing but that subtree, the
+ * LoopInfo of its loops, the task's own counts and, under a lock, new
+ * entries of wideOps, so subtrees can be analyzed in any order.
+ */
+void run_subtree_task(SubtreeTask *task) {
+    if (task->node->type == TOKEN_LOOP_START) {
+        fold_wide_adds(task->node->children, &task->node->numChildren, 1);
+    }
+    hoist_invariant_stores(task->node, 1);
+    if (task->markCopies) {
+        mark_copy_loops(task->node, 1, &task->copyLoops, &task->transformLoops);
+    }
+}
+
+/*
+ * next_task()
+ *
+ * Takes the next task from the queue, or returns NULL when none is left.
+ */
+SubtreeTask* next_task(TaskQueue *queue) {
+    SubtreeTask *task = NULL;
+#if OPT_THREADS
+    pthread_mutex_lock(&queue->lock);
+#endif
+    if (queue->next < queue->numTasks) {
+        task = &queue->tasks[queue->next++];
+    }
+#if OPT_THREADS
+    pthread_mutex_unlock(&queue->lock);
+#endif
+    return task;
+}
+
+/*
+ * subtree_worker()
+ *
+ * Thread body of the pass pool: runs tasks until the queue is empty.
+ */
+void* subtree_worker(void *arg) {
+    SubtreeTask *task;
+    while ((task = next_task(arg)) != NULL) {
+        run_subtree_task(task);
+    }
+    return NULL;
+}
+
+/*
+ * run_loop_passes()
+ *
+ * Runs the loop-local passes over every top-level loop of every stage, on
+ * up to --jobs threads, then merges the counts of the subtrees in program
+ * order. Copy and transform loops are only looked for in the first stage,
+ * and only if markCopies is set. The result is the same as that of a
+ * serial run, whatever the number of threads.
+ */
+void run_loop_passes(Stage *stages, int numStages, int markCopies) {
+    TaskQueue queue;
+    int total = 0;
+    for (int k = 0; k < numStages; k++) {
+        total += stages[k].numNodes;
+    }
+    queue.tasks = malloc((total > 0 ? total : 1) * sizeof(SubtreeTask));
+    queue.numTasks = queue.next = 0;
+    if (!queue.tasks) {
+        perror("Memory allocation failed in run_loop_passes()");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < numStages; k++) {
+        for (int i = 0; i < stages[k].numNodes; i++) {
+            ASTNode *node = &stages[k].nodes[i];
+            if (node->type == TOKEN_LOOP_START || node->type == TOKEN_WIDE_ADD) {
+                SubtreeTask task = {node, markCopies && k == 0, 0, 0};
+                queue.tasks[queue.numTasks++] = task;
+            }
+        }
+    }
+
+#if OPT_THREADS
+    // Fuel is drawn in program order, so that --opt-fuel gives the same
+    // output every time.
+    int numThreads = options.optFuel > 0 ? 0 :
+                     options.jobs < queue.numTasks ? options.jobs - 1 : queue.numTasks - 1;
+    pthread_t *threads = malloc((numThreads > 0 ? numThreads : 1) * sizeof(pthread_t));
+    if (!threads) {
+        perror("Memory allocation failed in run_loop_passes()");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&queue.lock, NULL);
+    for (int t = 0; t < numThreads; t++) {
+        // Without a thread, the calling thread simply takes more tasks.
+        if (pthread_create(&threads[t], NULL, subtree_worker, &queue) != 0) {
+            numThreads = t;
+        }
+    }
+    subtree_worker(&queue);
+    for (int t = 0; t < numThreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+    free(threads);
+#else
+    subtree_worker(&queue);
+#endif
+
+    for (int i = 0; i < queue.numTasks; i++) {
+        numCopyLoops += queue.tasks[i].copyLoops;
+        numTransformLoops += queue.tasks[i].transformLoops;
+    }
+    free(queue.tasks);
+}
+
+/*---------------------------------------------------------------
+ * Bytecode Phase: Flattened Program Representation
+ *--------------------------------------------------------------*/
+
+// Bytecode operations. Loops become a pair of conditional jumps.
+typedef enum {
+    BC_ADD,         // *ptr += arg
+    BC_MOVE,        // ptr += arg
+    BC_OUTPUT,      // Output *ptr arg times
+    BC_INPUT,       // Read arg bytes into *ptr
+    BC_JUMP_ZERO,   // If *ptr == 0, continue after instruction arg
+    BC_JUMP_NONZERO,// If *ptr != 0, continue after instruction arg
+    BC_NATIVE,      // ptr = native function arg (ptr)
+    BC_HALT
+} Opcode;
+
+typedef struct {
+    Opcode op;
+    int arg;
+    size_t pos;     // Source offset of the loop it came from, or NO_POSITION
+} Insn;
+
+typedef struct {
+    Insn *code;
+    int count;
+    int capacity;
+} Bytecode;
+
+/*
+ * emit_insn()
+ *
+ * Appends an instruction for the loop at source offset pos, if any, to
+ * the bytecode and returns its index. Jump operands are indices, so a
+ * program of more than INT_MAX instructions is rejected.
+ */
+int emit_insn(Bytecode *bc, Opcode op, int arg, size_t pos) {
+    if (bc->count >= bc->capacity) {
+        if (bc->count == INT_MAX) {
+            fprintf(stderr, "Error: Program too large: more than %d bytecode instructions\n", INT_MAX);
+            exit(EXIT_FAILURE);
+        }
+        bc->capacity = bc->capacity == 0 ? 128 : bc->capacity > INT_MAX / 2 ? INT_MAX : bc->capacity * 2;
+        bc->code = realloc(bc->code, (size_t)bc->capacity * sizeof(Insn));
+        if (!bc->code) {
+            perror("Memory reallocation failed in emit_insn()");
+            exit(EXIT_FAILURE);
+        }
+    }
+    bc->code[bc->count].op = op;
+    bc->code[bc->count].arg = arg;
+    bc->code[bc->count].pos = pos;
+    return bc->count++;
+}
+
+/*
+ * flatten()
+ *
+ * Appends the bytecode for an AST level. Loops with a native slot become a
+ * single BC_NATIVE instruction; the others are flattened into jumps.
+ */
+void flatten(ASTNode* nodes, int numNodes, Bytecode *bc) {
+    for (int i = 0; i < numNodes; i++) {
+        ASTNode *node = &nodes[i];
+        switch (node->type) {
+            case TOKEN_PLUS:     emit_insn(bc, BC_ADD, node->count % 256, node->pos); break;
+            case TOKEN_MINUS:    emit_insn(bc, BC_ADD, (256 - node->count % 256) % 256, node->pos); break;
+            case TOKEN_NEXT:     emit_insn(bc, BC_MOVE, node->count, node->pos); break;
+            case TOKEN_PREVIOUS: emit_insn(bc, BC_MOVE, -node->count, node->pos); break;
+            case TOKEN_OUTPUT:   emit_insn(bc, BC_OUTPUT, node->count, node->pos); break;
+            case TOKEN_INPUT:    emit_insn(bc, BC_INPUT, node->count, node->pos); break;
+            case TOKEN_WIDE_ADD: flatten(node->children, node->numChildren, bc); break;
+            case TOKEN_LOOP_START:
+                if (loopInfo[node->id].nativeSlot >= 0) {
+                    emit_insn(bc, BC_NATIVE, loopInfo[node->id].nativeSlot, node->pos);
+                } else {
+                    int start = emit_insn(bc, BC_JUMP_ZERO, 0, node->pos);
+                    flatten(node->children, node->numChildren, bc);
+                    int end = emit_insn(bc, BC_JUMP_NONZERO, start, node->pos);
+                    bc->code[start].arg = end;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/*
+ * mark_balanced_loops()
+ *
+ * Sets balanced[i] for both jumps of every loop whose body always leaves
+ * the pointer where it found it: its own moves sum to zero and every loop
+ * nested in it is balanced too.
+ */
+void mark_balanced_loops(const Bytecode *bc, unsigned char *balanced) {
+    int *starts = malloc(bc->count * sizeof(int));
+    long *moves = malloc(bc->count * sizeof(long));
+    unsigned char *unknown = malloc(bc->count);
+    int depth = 0;
+    if (!starts || !moves || !unknown) {
+        perror("Memory allocation failed in mark_balanced_loops()");
+        exit(EXIT_FAILURE);
+    }
+    memset(balanced, 0, bc->count);
+    for (int i = 0; i < bc->count; i++) {
+        switch (bc->code[i].op) {
+            case BC_JUMP_ZERO:
+                starts[depth] = i;
+                unknown[depth] = 0;
+                moves[depth++] = 0;
+                break;
+            case BC_MOVE:
+                if (depth > 0) {
+                    moves[depth - 1] += bc->code[i].arg;
+                }
+                break;
+            case BC_JUMP_NONZERO:
+                depth--;
+                if (moves[depth] == 0 && !unknown[depth]) {
+                    balanced[starts[depth]] = balanced[i] = 1;
+                } else if (depth > 0) {
+                    unknown[depth - 1] = 1;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    free(starts);
+    free(moves);
+    free(unknown);
+}
+
+// Layout of a .bfc file: the flattened program, ready to run in place once
+// mapped. Every field is in the byte order of the machine that wrote the
+// file, which byteOrder lets a reader check, and the sections start on
+// BFC_ALIGN boundaries.
+typedef struct {
+    char magic[8];              // BFC_MAGIC
+    uint32_t version;           // BFC_VERSION
+    uint32_t byteOrder;         // BFC_BYTE_ORDER as written
+    uint32_t insnSize;          // sizeof(BfcInsn)
+    uint32_t numInsns;          // Ending with BC_HALT
+    uint32_t codeOffset;        // File offset of the instructions
+    uint32_t positionOffset;    // File offset of the position table
+    uint32_t tapeSize;          // Cells the program expects
+    uint32_t checksum;          // Checksum of the program's AST
+} BfcHeader;
+
+// An instruction. Jump operands are instruction indices.
+typedef struct {
+    int32_t op;
+    int32_t arg;
+} BfcInsn;
+
+// Source position of the innermost loop around the instruction with the
+// same index, or 0 outside loops.
+typedef struct {
+    uint32_t line;
+    uint32_t column;
+} BfcPosition;
+
+/*
+ * bfc_align()
+ *
+ * Rounds a file offset up to the next section boundary.
+ */
+size_t bfc_align(size_t offset) {
+    return (offset + BFC_ALIGN - 1) / BFC_ALIGN * BFC_ALIGN;
+}
+
+/*
+ * write_section()
+ *
+ * Writes data to a .bfc file at the given offset, padding with zeros up to
+ * it.
+ */
+void write_section(FILE *fp, long offset, const void *data, size_t size) {
+    while (ftell(fp) < offset) {
+        fputc(0, fp);
+    }
+    if (size > 0 && fwrite(data, size, 1, fp) != 1) {
+        perror("Error writing bytecode file");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * write_bfc()
+ *
+ * Flattens the optimized program and writes it to a .bfc file, with the
+ * line and column of the loop each instruction belongs to.
+ */
+void write_bfc(const char *path, ASTNode* nodes, int numNodes, const Source *source) {
+    Bytecode bc = {0};
+    BfcHeader header = {BFC_MAGIC, BFC_VERSION, BFC_BYTE_ORDER, sizeof(BfcInsn), 0, 0, 0, TAPE_SIZE, 0};
+    flatten(nodes, numNodes, &bc);
+    emit_insn(&bc, BC_HALT, 0, NO_POSITION);
+
+    BfcInsn *code = malloc(bc.count * sizeof(BfcInsn));
+    BfcPosition *positions = malloc(bc.count * sizeof(BfcPosition));
+    int *open = malloc(bc.count * sizeof(int)), depth = 0;
+    if (!code || !positions || !open) {
+        perror("Memory allocation failed in write_bfc()");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < bc.count; i++) {
+        code[i].op = bc.code[i].op;
+        code[i].arg = bc.code[i].arg;
+        positions[i].line = positions[i].column = 0;
+        if (bc.code[i].op == BC_JUMP_ZERO) {
+            // Loops start in source order, so the lines are counted in a
+            // single pass. Beyond 2^32 lines or columns, the table saturates.
+            size_t line, column;
+            source_position(source, bc.code[i].pos, &line, &column);
+            positions[i].line = line < UINT32_MAX ? (uint32_t)line : UINT32_MAX;
+            positions[i].column = column < UINT32_MAX ? (uint32_t)column : UINT32_MAX;
+            open[depth++] = i;
+        } else if (bc.code[i].op == BC_JUMP_NONZERO) {
+            positions[i] = positions[open[--depth]];
+        } else if (depth > 0) {
+            positions[i] = positions[open[depth - 1]];
+        }
+    }
+
+    // Offsets in the header are 32-bit, which bounds the file to 4 GB.
+    size_t codeOffset = bfc_align(sizeof(BfcHeader));
+    size_t positionOffset = bfc_align(codeOffset + (size_t)bc.count * sizeof(BfcInsn));
+    if (positionOffset + (size_t)bc.count * sizeof(BfcPosition) > UINT32_MAX) {
+        fprintf(stderr, "Error: Program too large for a bytecode file: %d instructions do not fit in 4 GB\n",
+                bc.count);
+        exit(EXIT_FAILURE);
+    }
+    header.numInsns = (uint32_t)bc.count;
+    header.codeOffset = (uint32_t)codeOffset;
+    header.positionOffset = (uint32_t)positionOffset;
+    header.checksum = (uint32_t)programChecksum;
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        perror("Error opening bytecode file");
+        exit(EXIT_FAILURE);
+    }
+    write_section(fp, 0, &header, sizeof(header));
+    write_section(fp, header.codeOffset, code, bc.count * sizeof(BfcInsn));
+    write_section(fp, header.positionOffset, positions, bc.count * sizeof(BfcPosition));
+    if (fclose(fp) != 0) {
+        perror("Error writing bytecode file");
+        exit(EXIT_FAILURE);
+    }
+    free(open);
+    free(positions);
+    free(code);
+    free(bc.code);
+}
+
+/*
+ * map_bfc()
+ *
+ * Maps a .bfc file into memory read-only, or reads it where mmap is not
+ * available, and sets *size to its length.
+ */
+unsigned char* map_bfc(const char *path, size_t *size) {
+    unsigned char *data;
+#if BFC_MMAP
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror("Error opening bytecode file");
+        exit(EXIT_FAILURE);
+    }
+    *size = (size_t)st.st_size;
+    data = *size > 0 ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (data == MAP_FAILED) {
+        perror("Error mapping bytecode file");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+#else
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror("Error opening bytecode file");
+        exit(EXIT_FAILURE);
+    }
+    fseek(fp, 0, SEEK_END);
+    *size = (size_t)ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = malloc(*size + 1);
+    if (!data) {
+        perror("Memory allocation failed in map_bfc()");
+        exit(EXIT_FAILURE);
+    }
+    if (fread(data, 1, *size, fp) != *size) {
+        perror("Error reading bytecode file");
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+#endif
+    return data;
+}
+
+/*
+ * run_bfc()
+ *
+ * Runs a .bfc file on standard input and output, straight from its mapped
+ * instructions. The only work before the first instruction is a check of
+ * the header and of every jump target, so that a damaged file is rejected
+ * instead of running wild. Returns the exit status.
+ */
+int run_bfc(const char *path) {
+    size_t size;
+    unsigned char *data = map_bfc(path, &size);
+    const BfcHeader *header = (const BfcHeader *)data;
+    if (size < sizeof(BfcHeader) || memcmp(header->magic, BFC_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "Error: '%s' is not a bytecode file\n", path);
+        exit(EXIT_FAILURE);
+    }
+    if (header->version != BFC_VERSION || header->byteOrder != BFC_BYTE_ORDER ||
+        header->insnSize != sizeof(BfcInsn)) {
+        fprintf(stderr, "Error: '%s' was written by another version of brainfuck2c or on another machine\n", path);
+        exit(EXIT_FAILURE);
+    }
+    const BfcInsn *code = (const BfcInsn *)(data + header->codeOffset);
+    const BfcPosition *positions = (const BfcPosition *)(data + header->positionOffset);
+    uint32_t n = header->numInsns;
+    int valid = n > 0 && header->tapeSize > 0 &&
+                header->codeOffset % BFC_ALIGN == 0 && header->positionOffset % BFC_ALIGN == 0 &&
+                header->codeOffset <= size && (size - header->codeOffset) / sizeof(BfcInsn) >= n &&
+                header->positionOffset <= size && (size - header->positionOffset) / sizeof(BfcPosition) >= n;
+    for (uint32_t i = 0; valid && i < n; i++) {
+        switch (code[i].op) {
+            case BC_JUMP_ZERO:
+            case BC_JUMP_NONZERO:
+                valid = code[i].arg >= 0 && (uint32_t)code[i].arg < n;
+                break;
+            case BC_ADD: case BC_MOVE: case BC_OUTPUT: case BC_INPUT:
+                break;
+            default:
+                valid = code[i].op == BC_HALT && i == n - 1;
+                break;
+        }
+    }
+    if (!valid || code[n - 1].op != BC_HALT) {
+        fprintf(stderr, "Error: '%s' is damaged\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    unsigned char *tape = calloc(header->tapeSize, 1);
+    long cell = 0;
+    if (!tape) {
+        perror("Memory allocation failed for the tape");
+        exit(EXIT_FAILURE);
+    }
+    for (const BfcInsn *pc = code;; pc++) {
+        switch (pc->op) {
+            case BC_ADD: tape[cell] += pc->arg; break;
+            case BC_MOVE:
+                cell += pc->arg;
+                if (cell < 0 || cell >= (long)header->tapeSize) {
+                    const BfcPosition *at = &positions[pc - code];
+                    fflush(stdout);
+                    if (at->line == 0) {
+                        fprintf(stderr, "Error: Pointer moved off the tape\n");
+                    } else {
+                        fprintf(stderr, "Error: Pointer moved off the tape in the loop at line %u, column %u\n",
+                                (unsigned)at->line, (unsigned)at->column);
+                    }
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case BC_OUTPUT: for (int i = 0; i < pc->arg; i++) putchar(tape[cell]); break;
+            case BC_INPUT: for (int i = 0; i < pc->arg; i++) tape[cell] = (unsigned char)getchar(); break;
+            case BC_JUMP_ZERO: if (!tape[cell]) pc = code + pc->arg; break;
+            case BC_JUMP_NONZERO: if (tape[cell]) pc = code + pc->arg; break;
+            default:
+                free(tape);
+#if BFC_MMAP
+                munmap(data, size);
+#else
+                free(data);
+#endif
+                return fflush(stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+}
+
+/*
+ * mark_native_loops()
+ *
+ * Chooses the loops compiled to C in hybrid mode. With a profile these are
+ * the outermost hot loops; without one, the outermost loops nested inside
+ * another loop, since those are the ones that repeat. Memoized, copy and
+ * stream filter loops are always native, as the interpreter has no support
+ * for them.
+ */
+void mark_native_loops(ASTNode* nodes, int numNodes, int depth) {
+    for (int i = 0; i < numNodes; i++) {
+        if (nodes[i].type != TOKEN_LOOP_START) {
+            continue;
+        }
+        LoopInfo *info = &loopInfo[nodes[i].id];
+        int hot = (haveProfile ? info->hot : depth > 0) || info->memoSlot >= 0 || info->copyLoop || info->map;
+        if (hot && !info->outlined) {
+            info->nativeSlot = numNativeSlots++;
+        } else {
+            mark_native_loops(nodes[i].children, nodes[i].numChildren, depth + 1);
+        }
+    }
+}
+
+/*---------------------------------------------------------------
+ * Remarks Phase: Per-Loop Optimization Report
+ *--------------------------------------------------------------*/
+
+// A loop listed in the --remarks report, with what encloses it.
+typedef struct {
+    ASTNode *node;
+    int stage;              // Index of the program it belongs to
+    int inWide;             // Part of a recognized 16-bit addition
+    int inMemo;             // Nested in a memoized loop
+    int inNative;           // Nested in a native loop in hybrid mode
+    int hoisted;            // Replaced by a store before its parent loop
+} LoopSite;
+
+/*
+ * has_io()
+ *
+ * Returns nonzero if the nodes or any loop in them read or write.
+ */
+int has_io(ASTNode* nodes, int numNodes) {
+    for (int i = 0; i < numNodes; i++) {
+        if (nodes[i].type == TOKEN_INPUT || nodes[i].type == TOKEN_OUTPUT ||
+            ((nodes[i].type == TOKEN_LOOP_START || nodes[i].type == TOKEN_WIDE_ADD) &&
+             has_io(nodes[i].children, nodes[i].numChildren))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * hoist_reason()
+ *
+ * Returns why a loop with a constant store in its body keeps it there, or
+ * NULL if the loop has no such store or the store was hoisted.
+ */
+const char* hoist_reason(ASTNode* node) {
+    int offset = 0, found = 0, zero = 0;
+    if (loopInfo[node->id].hoisted) {
+        return NULL;
+    }
+    for (int i = 0; i < node->numChildren; i++) {
+        if (node->children[i].type == TOKEN_NEXT) {
+            offset += node->children[i].count;
+        } else if (node->children[i].type == TOKEN_PREVIOUS) {
+            offset -= node->children[i].count;
+        } else if (is_clear_loop(&node->children[i])) {
+            found = 1;
+            zero |= offset == 0;
+        }
+    }
+    if (!found) {
+        return NULL;
+    }
+    offset = 0;
+    if (cell_accesses(node->children, node->numChildren, 0, &offset) < 0 || offset != 0) {
+        return "unbalanced pointer";
+    }
+    return zero ? "store to the loop counter" : "stored cell used elsewhere in body";
+}
+
+/*
+ * collect_loop_sites()
+ *
+ * Appends every loop in the nodes, in source order, to *sites. The context
+ * describes what encloses the nodes.
+ */
+void collect_loop_sites(ASTNode* nodes, int numNodes, LoopSite context,
+                        LoopSite *sites, int *numSites) {
+    for (int i = 0; i < numNodes; i++) {
+        LoopSite inner = context;
+        if (nodes[i].type == TOKEN_LOOP_START) {
+            unsigned char *hoisted = context.node && nodes == context.node->children ?
+                                     loopInfo[context.node->id].hoisted : NULL;
+            inner.node = &nodes[i];
+            inner.hoisted = hoisted && hoisted[i];
+            sites[(*numSites)++] = inner;
+            inner.hoisted = 0;
+            inner.inMemo |= loopInfo[nodes[i].id].memoSlot >= 0;
+            inner.inNative |= loopInfo[nodes[i].id].nativeSlot >= 0;
+            collect_loop_sites(nodes[i].children, nodes[i].numChildren, inner, sites, numSites);
+        } else if (nodes[i].type == TOKEN_WIDE_ADD) {
+            inner.inWide = 1;
+            collect_loop_sites(nodes[i].children, nodes[i].numChildren, inner, sites, numSites);
+        }
+    }
+}
+
+/*
+ * compare_loop_sites()
+ *
+ * Orders loops by profile weight, heaviest first, then in source order.
+ */
+int compare_loop_sites(const void *a, const void *b) {
+    const LoopInfo *x = &loopInfo[((const LoopSite *)a)->node->id];
+    const LoopInfo *y = &loopInfo[((const LoopSite *)b)->node->id];
+    unsigned long long wx = x->entries + x->iterations, wy = y->entries + y->iterations;
+    if (wx != wy) {
+        return wx > wy ? -1 : 1;
+    }
+    return ((const LoopSite *)a)->node->id - ((const LoopSite *)b)->node->id;
+}
+
+int has_limits(void);
+
+/*
+ * emitted_as_while()
+ *
+ * Returns nonzero if a loop is printed as a C loop by generate_while(),
+ * where a counted loop is charged in one go under limits, needs no
+ * safepoint and may be unrolled, rather than run from bytecode or replaced
+ * by a bulk copy, a stream filter or a 16-bit addition.
+ */
+int emitted_as_while(LoopSite *site) {
+    LoopInfo *info = &loopInfo[site->node->id];
+    if (options.batch || options.emitBfc || site->inWide || info->copyLoop || info->map) {
+        return 0;
+    }
+    return !options.hybrid || info->nativeSlot >= 0 || site->inNative;
+}
+
+/*
+ * print_loop_remarks()
+ *
+ * Prints the passes that applied to one loop and, for those that did not,
+ * why they bailed out.
+ */
+void print_loop_remarks(FILE *out, LoopSite *site, unsigned long long total) {
+    ASTNode *node = site->node;
+    LoopInfo *info = &loopInfo[node->id];
+    const char *reason;
+    int low = 0, high = 0;
+
+    if (haveProfile) {
+        unsigned long long weight = info->entries + info->iterations;
+        fprintf(out, ", %.1f%% of profile weight%s", total ? 100.0 * weight / total : 0.0,
+                info->hot ? " (hot)" : weight == 0 ? " (never ran)" : "");
+    }
+    fprintf(out, "\n");
+    if (site->hoisted) {
+        // The loop is gone: a store before its parent runs in its place.
+        fprintf(out, "    applied  hoisted out of its parent loop as a constant store\n");
+        return;
+    }
+    if (info->outlined) {
+        fprintf(out, "    applied  outlined: never ran\n");
+    }
+    if (info->hot && info->iterations >= 4 * info->entries) {
+        fprintf(out, "    applied  branch hint: body likely\n");
+    } else if (info->hot && 4 * info->iterations <= info->entries) {
+        fprintf(out, "    applied  branch hint: body unlikely\n");
+    }
+    int step = 0;
+    if ((reason = counted_loop_reason(node, &step)) != NULL) {
+        fprintf(out, "    missed   counted loop: %s\n", reason);
+    } else if (emitted_as_while(site) && (has_limits() || options.checkpoint || info->numSpecialized > 0)) {
+        // Otherwise the loop is printed as a plain while loop all the same.
+        fprintf(out, "    applied  counted loop: step %+d%s%s\n", step,
+                has_limits() ? ", charged before it runs" : "", options.checkpoint ? ", no safepoint" : "");
+    }
+    for (int s = 0; s < info->numSpecialized; s++) {
+        fprintf(out, "    applied  unrolled for entry value %d\n", info->specialized[s]);
+    }
+    if (site->inWide) {
+        fprintf(out, "    applied  part of a 16-bit addition\n");
+    }
+    if (info->copyLoop) {
+        fprintf(out, "    applied  bulk copy\n");
+    } else if (info->map) {
+        fprintf(out, "    applied  stream filter table\n");
+    }
+    if (info->hoisted) {
+        int stores = 0;
+        for (int i = 0; i < node->numChildren; i++) {
+            stores += info->hoisted[i] && node->children[i].type == TOKEN_LOOP_START;
+        }
+        fprintf(out, "    applied  hoisted %d constant store%s\n", stores, stores == 1 ? "" : "s");
+    } else if ((reason = hoist_reason(node)) != NULL) {
+        fprintf(out, "    missed   store hoisting: %s\n", reason);
+    }
+    if (options.memoize) {
+        if (info->memoSlot >= 0) {
+            fprintf(out, "    applied  memoized: window of %d cells\n", info->memoHigh - info->memoLow + 1);
+        } else if (site->inMemo) {
+            fprintf(out, "    missed   memoization: inside a memoized loop\n");
+        } else if (info->outlined) {
+            fprintf(out, "    missed   memoization: never ran\n");
+        } else if (has_io(node->children, node->numChildren)) {
+            fprintf(out, "    missed   memoization: I/O in body\n");
+        } else if (!pure_loop_window(node, &low, &high)) {
+            fprintf(out, "    missed   memoization: unbalanced pointer\n");
+        } else if (high - low + 1 > MEMO_WINDOW) {
+            fprintf(out, "    missed   memoization: window of %d cells is too wide\n", high - low + 1);
+        } else {
+            fprintf(out, "    missed   memoization: no nested loop\n");
+        }
+    }
+    if (info->nativeSlot >= 0) {
+        fprintf(out, "    applied  compiled natively\n");
+    } else if (site->inNative) {
+        fprintf(out, "    applied  compiled natively as part of an enclosing loop\n");
+    } else if (options.hybrid) {
+        fprintf(out, "    missed   compiled natively: %s\n", info->outlined ? "never ran" : "not hot");
+    }
+}
+
+/*
+ * write_remarks()
+ *
+ * Writes the --remarks report: every loop with its source position, the
+ * passes that applied to it and the reasons the others bailed out. With a
+ * profile, the heaviest loops come first.
+ */
+void write_remarks(Stage *stages, int numStages) {
+    FILE *out = stderr;
+    LoopSite *sites = malloc((numLoops > 0 ? numLoops : 1) * sizeof(LoopSite));
+    unsigned long long total = 0;
+    int numSites = 0;
+    if (!sites) {
+        perror("Memory allocation failed in write_remarks()");
+        exit(EXIT_FAILURE);
+    }
+    if (*options.remarks && !(out = fopen(options.remarks, "w"))) {
+        perror("Error opening remarks file");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < numStages; k++) {
+        LoopSite context = {NULL, k, 0, 0, 0, 0};
+        collect_loop_sites(stages[k].nodes, stages[k].numNodes, context, sites, &numSites);
+    }
+    if (haveProfile) {
+        qsort(sites, numSites, sizeof(LoopSite), compare_loop_sites);
+    }
+    for (int i = 0; i < numLoops; i++) {
+        total += loopInfo[i].entries + loopInfo[i].iterations;
+    }
+    for (int i = 0; i < numSites; i++) {
+        Stage *stage = &stages[sites[i].stage];
+        const char *path = options.pipeline ? options.stagePaths[sites[i].stage] : options.inputPath;
+        size_t line, column;
+        source_position(&stage->source, sites[i].node->pos, &line, &column);
+        fprintf(out, "%s:%zu:%zu: loop %d", path ? path : "<stdin>", line, column, sites[i].node->id);
+        print_loop_remarks(out, &sites[i], total);
+    }
+    if (out != stderr) {
+        fclose(out);
+    }
+    free(sites);
+}
+
+/*---------------------------------------------------------------
+ * Generator Phase: Code Generation Functions
+ *--------------------------------------------------------------*/
+void print_indent(int level) {
+    for (int i = 0; i < level; i++) {
+        printf("    ");
+    }
+}
+
+void generate_code(ASTNode* nodes, int numNodes, int indent_level);
+void print_c_string(const char *str);
+
+/*
+ * has_limits()
+ *
+ * Returns nonzero if the generated program runs under the governor.
+ */
+int has_limits(void) {
+    return options.maxSteps || options.maxOutput || options.timeout > 0;
+}
+
+/*
+ * loop_condition()
+ *
+ * Returns the condition of a loop's while statement. With a profile, the
+ * condition of a hot loop carries a branch hint when the recorded counts show
+ * that the body almost always or almost never runs.
+ */
+const char* loop_condition(ASTNode* node) {
+    if (loopInfo[node->id].hot) {
+        LoopInfo *info = &loopInfo[node->id];
+        if (info->iterations >= 4 * info->entries) {
+            return "BF_LIKELY(*ptr)";
+        }
+        if (4 * info->iterations <= info->entries) {
+            return "BF_UNLIKELY(*ptr)";
+        }
+    }
+    return "*ptr";
+}
+
+/*
+ * generate_hoisted_stores()
+ *
+ * Prints the constant stores hoisted out of a loop body. In instrumented
+ * builds each store counts as an entry of the clear loop it replaces, so
+ * that the profile does not show that loop as never run.
+ */
+void generate_hoisted_stores(ASTNode* node, int indent_level) {
+    unsigned char *hoisted = loopInfo[node->id].hoisted;
+    int offset = 0;
+    for (int i = 0; i < node->numChildren; i++) {
+        ASTNode *child = &node->children[i];
+        if (child->type == TOKEN_NEXT) {
+            offset += child->count;
+        } else if (child->type == TOKEN_PREVIOUS) {
+            offset -= child->count;
+        } else if (hoisted[i] && child->type == TOKEN_LOOP_START) {
+            int value = i + 1 < node->numChildren && hoisted[i + 1] ? loop_adjust(node->children, i + 1, i + 2) : 0;
+            if (options.profileGenerate) {
+                print_indent(indent_level);
+                printf("bf_prof_entries[%d]++;\n", child->id);
+            }
+            print_indent(indent_level);
+            printf("ptr[%d] = %d;\n", offset, value);
+        }
+    }
+}
+
+/*
+ * generate_body()
+ *
+ * Prints the body of a loop, leaving out the stores hoisted out of it.
+ */
+void generate_body(ASTNode* node, int indent_level) {
+    unsigned char *hoisted = loopInfo[node->id].hoisted;
+    int start = 0;
+    for (int i = 0; hoisted && i < node->numChildren; i++) {
+        if (hoisted[i]) {
+            generate_code(node->children + start, i - start, indent_level);
+            start = i + 1;
+        }
+    }
+    generate_code(node->children + start, node->numChildren - start, indent_level);
+}
+
+/*
+ * charged_loop_step()
+ *
+ * Returns the counter step of a loop that the governor charges in one go
+ * before it starts: a counted loop, or a loop that would be one if not for
+ * 16-bit additions that leave its counter cell alone. An addition counts
+ * as one operation; when it falls back to its original code, the loops in
+ * that code charge their own iterations. Returns 0 for any other loop.
+ */
+int charged_loop_step(ASTNode* node) {
+    int offset = 0, step = counted_loop_step(node);
+    if (step != 0) {
+        return step;
+    }
+    for (int i = 0; i < node->numChildren; i++) {
+        ASTNode *child = &node->children[i];
+        switch (child->type) {
+            case TOKEN_PLUS:     if (offset == 0) step += child->count; break;
+            case TOKEN_MINUS:    if (offset == 0) step -= child->count; break;
+            case TOKEN_NEXT:     offset += child->count; break;
+            case TOKEN_PREVIOUS: offset -= child->count; break;
+            case TOKEN_OUTPUT:   break;
+            case TOKEN_WIDE_ADD: {
+                WideOp *op = &wideOps[child->id];
+                int cell = -offset;
+                if (cell == op->lowCell || cell == op->highCell ||
+                    (cell >= op->windowLow && cell <= op->windowHigh &&
+                     op->scratch >> (cell - op->windowLow) & 1)) {
+                    return 0;
+                }
+                break;
+            }
+            default:
+                return 0;
+        }
+    }
+    step = ((step % 256) + 256) % 256;
+    return offset != 0 ? 0 : step == 1 ? 1 : step == 255 ? -1 : 0;
+}
+
+/*
+ * scan_loop_shift()
+ *
+ * Returns how far a loop without nested loops, such as "[>]" or "[-<]",
+ * moves the pointer per iteration, or 0 if it has nested loops or leaves
+ * the pointer where it was. Such a loop stops within one pass over the
+ * tape, so the governor can charge it once it has ended, from the distance
+ * the pointer went.
+ */
+int scan_loop_shift(ASTNode* node) {
+    int offset = 0;
+    for (int i = 0; i < node->numChildren; i++) {
+        switch (node->children[i].type) {
+            case TOKEN_NEXT:       offset += node->children[i].count; break;
+            case TOKEN_PREVIOUS:   offset -= node->children[i].count; break;
+            case TOKEN_LOOP_START:
+            case TOKEN_WIDE_ADD:   return 0;
+            default:               break;
+        }
+    }
+    return offset;
+}
+
+/*
+ * generate_while()
+ *
+ * Prints a loop as a while statement, counting iterations in instrumented
+ * builds. Past the --flat-depth loop nesting level, counted within the
+ * function being printed, the loop is printed as labels and conditional
+ * gotos at the current indentation instead, so that deeply
+ * nested programs produce output of linear size that C compilers accept.
+ * Stores hoisted out of the body run once, after the first test.
+ */
+void generate_while(ASTNode* node, int indent_level) {
+    const char *condition = loop_condition(node);
+    int flat = loopDepth + 1 > options.flatDepth;
+    int hoisted = loopInfo[node->id].hoisted != NULL;
+    int body_level = flat ? indent_level : indent_level + 1 + hoisted;
+    int step = counted_loop_step(node), charged = has_limits() ? charged_loop_step(node) : 0;
+    int safepoint = options.checkpoint && step == 0;
+    // A resumed checkpoint enters the loop past the start of a scan.
+    int shift = has_limits() && charged == 0 && !safepoint ? scan_loop_shift(node) : 0;
+
+    if (charged != 0) {
+        // A counted loop is charged in one go, keeping its body free of
+        // checks so that the C compiler can still vectorize or fold it.
+        print_indent(indent_level);
+        printf("BF_TICK(%d * (long)(unsigned char)%s*ptr);\n", node->numChildren + 1, charged < 0 ? "" : "-");
+    } else if (shift != 0) {
+        print_indent(indent_level);
+        printf("unsigned char *bf_scan_%d = ptr;\n", node->id);
+    }
+    print_indent(indent_level);
+    if (flat) {
+        printf("if (!%s) goto bf_end_%d;\n", condition, node->id);
+        if (hoisted) {
+            generate_hoisted_stores(node, indent_level);
+        }
+        print_indent(indent_level);
+        printf("bf_top_%d:;\n", node->id);
+    } else if (hoisted) {
+        printf("if (%s) {\n", condition);
+        generate_hoisted_stores(node, indent_level + 1);
+        print_indent(indent_level + 1);
+        printf("do {\n");
+    } else {
+        printf("while (%s) {\n", condition);
+    }
+    if (safepoint) {
+        print_indent(body_level);
+        printf("bf_resume_%d:;\n", node->id);
+    }
+    if (options.profileGenerate) {
+        print_indent(body_level);
+        printf("bf_prof_iters[%d]++;\n", node->id);
+    }
+    if (has_limits() && charged == 0 && shift == 0) {
+        // Charge each iteration as it starts: one step per operation in the
+        // body, plus the test. Nested loops charge their own iterations.
+        print_indent(body_level);
+        printf("BF_TICK(%d);\n", node->numChildren + 1);
+    }
+    loopDepth++;
+    generate_body(node, body_level);
+    loopDepth--;
+    if (safepoint) {
+        // Counted loops end within 255 iterations and need no safepoint.
+        print_indent(body_level);
+        printf("if (%s) BF_SAFEPOINT(%d);\n", condition, node->id);
+    }
+    if (flat) {
+        print_indent(indent_level);
+        printf("if (%s) goto bf_top_%d;\n", condition, node->id);
+        print_indent(indent_level);
+        printf("bf_end_%d:;\n", node->id);
+    } else {
+        if (hoisted) {
+            print_indent(indent_level + 1);
+            printf("} while (%s);\n", condition);
+        }
+        print_indent(indent_level);
+        printf("}\n");
+    }
+    if (shift != 0) {
+        print_indent(indent_level);
+        printf("BF_TICK((ptr - bf_scan_%d) / %d * %dL);\n", node->id, shift, node->numChildren + 1);
+    }
+}
+
+/*
+ * generate_loop()
+ *
+ * Prints a loop at its place in the program. Loops that the profile shows
+ * were never reached are replaced by a call to their cold function.
+ */
+void generate_loop(ASTNode* node, int indent_level) {
+    if (options.lineDirectives) {
+        size_t line, column;
+        source_position(programSource, node->pos, &line, &column);
+        printf("#line %zu ", line);
+        print_c_string(options.inputPath ? options.inputPath : "<stdin>");
+        putchar('\n');
+    }
+    if (options.profileGenerate) {
+        print_indent(indent_level);
+        printf("bf_prof_entries[%d]++;\n", node->id);
+        if (loopInfo[node->id].valueSlot >= 0) {
+            print_indent(indent_level);
+            printf("bf_prof_values[%d][*ptr]++;\n", loopInfo[node->id].valueSlot);
+        }
+    }
+    if (loopInfo[node->id].outlined) {
+        print_indent(indent_level);
+        printf("if (BF_UNLIKELY(*ptr)) ptr = bf_cold_%d(ptr);\n", node->id);
+        return;
+    }
+    LoopInfo *info = &loopInfo[node->id];
+    if (info->copyLoop) {
+        // Copy the input in bulk; the loop itself only runs at end of input.
+        int before, after;
+        copy_loop_shape(node, &before, &after);
+        print_indent(indent_level);
+        printf("if (*ptr) {\n");
+        if (before) {
+            print_indent(indent_level + 1);
+            printf("*ptr += %d;\n", before);
+        }
+        print_indent(indent_level + 1);
+        printf("bf_putc(*ptr);\n");
+        print_indent(indent_level + 1);
+        printf("*ptr = bf_copy_until(%d);\n", (256 - after) % 256);
+        if (after) {
+            print_indent(indent_level + 1);
+            printf("*ptr += %d;\n", after);
+        }
+        generate_while(node, indent_level + 1);
+        print_indent(indent_level);
+        printf("}\n");
+        return;
+    }
+    if (info->map) {
+        // Filter the input in bulk once the scratch cells are known to be
+        // clear; the loop itself handles the first entry otherwise, and end
+        // of input.
+        int after = (256 - info->mapStop) % 256;
+        print_indent(indent_level);
+        printf("if (*ptr");
+        for (int d = info->mapLow; d <= info->mapHigh; d++) {
+            if (d != 0) {
+                printf(" && !ptr[%d]", d);
+            }
+        }
+        printf(") {\n");
+        print_indent(indent_level + 1);
+        printf("bf_putc(bf_map_%d[(unsigned char)(*ptr - %d)]);\n", node->id, after);
+        print_indent(indent_level + 1);
+        int add = map_is_affine(info->map, info->mapStop);
+        if (add >= 0) {
+            printf("*ptr = bf_transform_until(NULL, %d, %d);\n", add, info->mapStop);
+        } else {
+            printf("*ptr = bf_transform_until(bf_map_%d, 0, %d);\n", node->id, info->mapStop);
+        }
+        if (after) {
+            print_indent(indent_level + 1);
+            printf("*ptr += %d;\n", after);
+        }
+        print_indent(indent_level);
+        printf("}\n");
+        generate_while(node, indent_level);
+        return;
+    }
+    if (info->memoSlot >= 0) {
+        // Replay a cached exit state, or run the loop and record its effect.
+        int width = info->memoHigh - info->memoLow + 1;
+        print_indent(indent_level);
+        printf("if (*ptr && !bf_memo_replay(&bf_memo[%d], ptr - %d, %d)) {\n",
+               info->memoSlot, -info->memoLow, width);
+        print_indent(indent_level + 1);
+        printf("unsigned char key[%d];\n", width);
+        print_indent(indent_level + 1);
+        printf("memcpy(key, ptr - %d, %d);\n", -info->memoLow, width);
+        generate_while(node, indent_level + 1);
+        print_indent(indent_level + 1);
+        printf("bf_memo_record(&bf_memo[%d], key, ptr - %d, %d);\n",
+               info->memoSlot, -info->memoLow, width);
+        print_indent(indent_level);
+        printf("}\n");
+        return;
+    }
+    if (info->numSpecialized == 0) {
+        generate_while(node, indent_level);
+        return;
+    }
+    // Fully unrolled copies for the common entry values, then the generic loop.
+    int step = counted_loop_step(node);
+    for (int s = 0; s < info->numSpecialized; s++) {
+        print_indent(indent_level);
+        printf("%sif (*ptr == %d) {\n", s == 0 ? "" : "} else ", info->specialized[s]);
+        int trips = counted_loop_trips(step, info->specialized[s]);
+        for (int t = 0; t < trips; t++) {
+            generate_code(node->children, node->numChildren, indent_level + 1);
+        }
+    }
+    print_indent(indent_level);
+    printf("} else {\n");
+    generate_while(node, indent_level + 1);
+    print_indent(indent_level);
+    printf("}\n");
+}
+
+/*
+ * generate_wide_add()
+ *
+ * Prints a recognized multi-cell addition as one 16-bit addition on the
+ * two cells, provided its scratch cells are clear as the analysis assumed.
+ * The original code runs otherwise. When the big end directly follows the
+ * little end, BF_ADD16 adds to both cells as one 16-bit number instead of
+ * combining and splitting the bytes, which would put several instructions
+ * on the path from one iteration's sum to the next.
+ */
+void generate_wide_add(ASTNode* node, int indent_level) {
+    WideOp *op = &wideOps[node->id];
+    int scratch = 0;
+    print_indent(indent_level);
+    for (int d = op->windowLow; d <= op->windowHigh; d++) {
+        if (op->scratch >> (d - op->windowLow) & 1) {
+            printf("%s!ptr[%d]", scratch++ ? " && " : "if (", d);
+        }
+    }
+    printf("%s{\n", scratch ? ") " : "");
+    print_indent(indent_level + 1);
+    if (op->highCell == op->lowCell + 1) {
+        printf("BF_ADD16(&ptr[%d], %du);\n", op->lowCell, op->add);
+    } else {
+        printf("unsigned wide = ptr[%d] + 256u * ptr[%d] + %du;\n", op->lowCell, op->highCell, op->add);
+        print_indent(indent_level + 1);
+        printf("ptr[%d] = (unsigned char)wide;\n", op->lowCell);
+        print_indent(indent_level + 1);
+        printf("ptr[%d] = (unsigned char)(wide >> 8);\n", op->highCell);
+    }
+    print_indent(indent_level);
+    if (scratch) {
+        printf("} else {\n");
+        generate_code(node->children, node->numChildren, indent_level + 1);
+        print_indent(indent_level);
+    }
+    printf("}\n");
+}
+
+/*
+ * generate_cold_functions()
+ *
+ * Prints one function per outlined loop. They are marked cold so that the C
+ * compiler moves them away from the hot code and optimizes them for size.
+ * Under limits each one charges its loops against a slice of its own, and
+ * gives back what it did not use when it returns.
+ */
+void generate_cold_functions(ASTNode* nodes, int numNodes) {
+    for (int i = 0; i < numNodes; i++) {
+        if (nodes[i].type == TOKEN_WIDE_ADD) {
+            generate_cold_functions(nodes[i].children, nodes[i].numChildren);
+        }
+        if (nodes[i].type != TOKEN_LOOP_START) {
+            continue;
+        }
+        if (loopInfo[nodes[i].id].outlined) {
+            printf("static BF_COLD unsigned char *bf_cold_%d(unsigned char *ptr) {\n", nodes[i].id);
+            if (has_limits()) {
+                printf("    long bf_slice = 0;\n");
+            }
+            generate_while(&nodes[i], 1);
+            if (has_limits()) {
+                printf("    bf_governor_release(bf_slice);\n");
+            }
+            printf("    return ptr;\n");
+            printf("}\n\n");
+        } else {
+            generate_cold_functions(nodes[i].children, nodes[i].numChildren);
+        }
+    }
+}
+
+/*
+ * generate_native_functions()
+ *
+ * Prints one function per native loop in hybrid mode, and the table the
+ * interpreter calls them through.
+ */
+void generate_native_functions(ASTNode* nodes, int numNodes) {
+    for (int i = 0; i < numNodes; i++) {
+        if (nodes[i].type != TOKEN_LOOP_START) {
+            continue;
+        }
+        if (loopInfo[nodes[i].id].nativeSlot >= 0) {
+            printf("static unsigned char *bf_native_%d(unsigned char *ptr) {\n", nodes[i].id);
+            generate_loop(&nodes[i], 1);
+            printf("    return ptr;\n");
+            printf("}\n\n");
+        } else {
+            generate_native_functions(nodes[i].children, nodes[i].numChildren);
+        }
+    }
+}
+
+/*
+ * print_bytecode()
+ *
+ * Prints the opcode names, the instruction type and the bf_code array
+ * holding the bytecode.
+ */
+void print_bytecode(const Bytecode *bc) {
+    printf("enum { BC_ADD, BC_MOVE, BC_OUTPUT, BC_INPUT, BC_JUMP_ZERO, BC_JUMP_NONZERO, BC_NATIVE, BC_HALT };\n\n");
+    printf("typedef struct {\n");
+    printf("    unsigned char op;\n");
+    printf("    int arg;\n");
+    printf("} bf_insn;\n\n");
+    printf("static const bf_insn bf_code[%d] = {", bc->count);
+    for (int i = 0; i < bc->count; i++) {
+        printf("%s{%d,%d}", i % 8 == 0 ? "\n    " : " ", bc->code[i].op, bc->code[i].arg);
+        if (i + 1 < bc->count) {
+            putchar(',');
+        }
+    }
+    printf("\n};\n\n");
+}
+
+/*
+ * generate_interpreter()
+ *
+ * Prints the bytecode blob for the whole program and the interpreter that
+ * runs it in hybrid mode.
+ */
+void generate_interpreter(ASTNode* nodes, int numNodes) {
+    Bytecode bc = {0};
+    flatten(nodes, numNodes, &bc);
+    emit_insn(&bc, BC_HALT, 0, NO_POSITION);
+
+    print_bytecode(&bc);
+    if (numNativeSlots > 0) {
+        printf("static unsigned char *(*const bf_natives[%d])(unsigned char *) = {", numNativeSlots);
+        for (int i = 0, n = 0; i < numLoops; i++) {
+            if (loopInfo[i].nativeSlot >= 0) {
+                printf("%s\n    bf_native_%d", n++ ? "," : "", i);
+            }
+        }
+        printf("\n};\n\n");
+    }
+    printf("static void bf_interpret(unsigned char *ptr) {\n");
+    printf("    const bf_insn *pc = bf_code;\n");
+    printf("    int i;\n");
+    printf("    for (;; pc++) {\n");
+    printf("        switch (pc->op) {\n");
+    printf("            case BC_ADD: *ptr += pc->arg; break;\n");
+    printf("            case BC_MOVE: ptr += pc->arg; break;\n");
+    printf("            case BC_OUTPUT: for (i = 0; i < pc->arg; i++) bf_putc(*ptr); break;\n");
+    printf("            case BC_INPUT: for (i = 0; i < pc->arg; i++) *ptr = bf_getc(); break;\n");
+    printf("            case BC_JUMP_ZERO: if (!*ptr) pc = bf_code + pc->arg; break;\n");
+    printf("            case BC_JUMP_NONZERO: if (*ptr) pc = bf_code + pc->arg; break;\n");
+    if (numNativeSlots > 0) {
+        printf("            case BC_NATIVE: ptr = bf_natives[pc->arg](ptr); break;\n");
+    }
+    printf("            default: return;\n");
+    printf("        }\n");
+    printf("    }\n");
+    printf("}\n\n");
+    free(bc.code);
+}
+
+// Buffered I/O runtime of the generated program. Output is flushed before
+// every blocking read and at exit, and after each line on a terminal.
+const char *const IO_RUNTIME[] = {
+    "#define BF_IO_BUFFER 65536",
+    "",
+    "/* Hooks for the execution governor: output accounting, and checks made",
+    " * while blocked on I/O. */",
+    "#ifndef BF_ON_OUTPUT",
+    "#define BF_ON_OUTPUT(n) ((void)0)",
+    "#endif",
+    "#ifndef BF_ON_WAIT",
+    "#define BF_ON_WAIT() ((void)0)",
+    "#endif",
+    "",
+    "static unsigned char bf_in[BF_IO_BUFFER];",
+    "static unsigned char bf_out[BF_IO_BUFFER];",
+    "static size_t bf_in_pos, bf_in_len, bf_out_len;",
+    "static unsigned long long bf_in_total, bf_out_total;",
+    "static int bf_in_eof, bf_out_tty, bf_flush_before_read = 1;",
+    "",
+    "static inline void bf_write_all(const unsigned char *data, size_t len) {",
+    "    bf_out_total += len;",
+    "#if BF_POSIX_IO",
+    "    while (len > 0) {",
+    "        ssize_t n = write(1, data, len);",
+    "        if (n < 0) {",
+    "            if (errno == EINTR) {",
+    "                BF_ON_WAIT();",
+    "                continue;",
+    "            }",
+    "            perror(\"write\");",
+    "            exit(EXIT_FAILURE);",
+    "        }",
+    "        data += n;",
+    "        len -= (size_t)n;",
+    "    }",
+    "#else",
+    "    fwrite(data, 1, len, stdout);",
+    "    fflush(stdout);",
+    "#endif",
+    "}",
+    "",
+    "static inline void bf_flush(void) {",
+    "    bf_write_all(bf_out, bf_out_len);",
+    "    bf_out_len = 0;",
+    "}",
+    "",
+    "static inline int bf_fill(void) {",
+    "    if (bf_in_eof) {",
+    "        return 0;",
+    "    }",
+    "    if (bf_flush_before_read) {",
+    "        bf_flush();",
+    "    }",
+    "#if BF_POSIX_IO",
+    "    {",
+    "        ssize_t n;",
+    "        do {",
+    "            BF_ON_WAIT();",
+    "            n = read(0, bf_in, BF_IO_BUFFER);",
+    "        } while (n < 0 && errno == EINTR);",
+    "        if (n <= 0) {",
+    "            bf_in_eof = 1;",
+    "            return 0;",
+    "        }",
+    "        bf_in_len = (size_t)n;",
+    "        bf_in_total += (size_t)n;",
+    "    }",
+    "#else",
+    "    {",
+    "        int c = getchar();",
+    "        if (c == EOF) {",
+    "            bf_in_eof = 1;",
+    "            return 0;",
+    "        }",
+    "        bf_in[0] = (unsigned char)c;",
+    "        bf_in_len = 1;",
+    "        bf_in_total++;",
+    "    }",
+    "#endif",
+    "    bf_in_pos = 0;",
+    "    return 1;",
+    "}",
+    "",
+    "static inline int bf_getc(void) {",
+    "    if (bf_in_pos == bf_in_len && !bf_fill()) {",
+    "        return EOF;",
+    "    }",
+    "    return bf_in[bf_in_pos++];",
+    "}",
+    "",
+    "static inline void bf_putc(int c) {",
+    "    BF_ON_OUTPUT(1);",
+    "    bf_out[bf_out_len++] = (unsigned char)c;",
+    "    if (bf_out_len == BF_IO_BUFFER || (c == '\\n' && bf_out_tty)) {",
+    "        bf_flush();",
+    "    }",
+    "}",
+    "",
+    "static inline void bf_put_block(const unsigned char *data, size_t len) {",
+    "    BF_ON_OUTPUT(len);",
+    "    if (bf_out_len + len <= BF_IO_BUFFER) {",
+    "        memcpy(bf_out + bf_out_len, data, len);",
+    "        bf_out_len += len;",
+    "    } else {",
+    "        bf_flush();",
+    "        bf_write_all(data, len);",
+    "    }",
+    "    if (bf_out_tty) {",
+    "        bf_flush();",
+    "    }",
+    "}",
+    "",
+    "static inline void bf_io_init(void) {",
+    "#if BF_POSIX_IO",
+    "    bf_out_tty = isatty(1);",
+    "#else",
+    "    bf_out_tty = 1;",
+    "#endif",
+    "    atexit(bf_flush);",
+    "}",
+    NULL
+};
+
+// Execution governor of a program built with limits. Loops charge the cost
+// of each iteration against a slice of the step budget, held in a local of
+// the function the loops are in so that it can stay in a register; only
+// when a slice runs out does the slow path refill it and look at the timer
+// flag.
+const char *const GOVERNOR_RUNTIME[] = {
+    "#define BF_EXIT_STEPS 122",
+    "#define BF_EXIT_OUTPUT 123",
+    "#define BF_EXIT_TIMEOUT 124",
+    "#define BF_SLICE 65536L",
+    "#if defined(__GNUC__)",
+    "#define BF_SLOW_PATH __attribute__((cold))",
+    "#else",
+    "#define BF_SLOW_PATH",
+    "#endif",
+    "",
+    "#if defined(__GNUC__)",
+    "#define BF_TICK(n) if (__builtin_expect((bf_slice -= (n)) < 0, 0)) bf_slice = bf_governor_check(bf_slice)",
+    "#else",
+    "#define BF_TICK(n) if ((bf_slice -= (n)) < 0) bf_slice = bf_governor_check(bf_slice)",
+    "#endif",
+    "#define BF_ON_WAIT() (bf_timed_out ? bf_limit_exceeded(\"time\", BF_EXIT_TIMEOUT) : (void)0)",
+    "#if BF_MAX_OUTPUT",
+    "#define BF_ON_OUTPUT(n) bf_count_output(n)",
+    "#endif",
+    "",
+    "static volatile sig_atomic_t bf_timed_out;",
+    "#if BF_MAX_STEPS",
+    "static unsigned long long bf_steps_left = BF_MAX_STEPS;",
+    "#endif",
+    "static unsigned long long bf_output_left = BF_MAX_OUTPUT;",
+    "",
+    "static inline void bf_limit_exceeded(const char *what, int status) {",
+    "    fprintf(stderr, \"bf: %s limit exceeded\\n\", what);",
+    "    exit(status);",
+    "}",
+    "",
+    "/* Refills a slice that ran out and returns it. */",
+    "static inline BF_SLOW_PATH long bf_governor_check(long slice) {",
+    "    BF_ON_WAIT();",
+    "#if BF_MAX_STEPS",
+    "    while (slice < 0 && bf_steps_left > 0) {",
+    "        long take = bf_steps_left < BF_SLICE ? (long)bf_steps_left : BF_SLICE;",
+    "        bf_steps_left -= (unsigned long long)take;",
+    "        slice += take;",
+    "    }",
+    "    if (slice < 0) {",
+    "        bf_limit_exceeded(\"step\", BF_EXIT_STEPS);",
+    "    }",
+    "    return slice;",
+    "#else",
+    "    (void)slice;",
+    "    return BF_SLICE;",
+    "#endif",
+    "}",
+    "",
+    "/* Gives the rest of a function's slice back to the budget on return. */",
+    "static inline void bf_governor_release(long slice) {",
+    "#if BF_MAX_STEPS",
+    "    bf_steps_left += (unsigned long long)slice;",
+    "#else",
+    "    (void)slice;",
+    "#endif",
+    "}",
+    "",
+    "static inline void bf_count_output(size_t n) {",
+    "    if (n > bf_output_left) {",
+    "        bf_limit_exceeded(\"output\", BF_EXIT_OUTPUT);",
+    "    }",
+    "    bf_output_left -= n;",
+    "}",
+    "",
+    "#if BF_TIMEOUT_USEC",
+    "static void bf_on_alarm(int sig) {",
+    "    (void)sig;",
+    "    bf_timed_out = 1;",
+    "}",
+    "#endif",
+    "",
+    "static inline void bf_governor_init(void) {",
+    "#if BF_TIMEOUT_USEC",
+    "    struct sigaction sa;",
+    "    struct itimerval timer;",
+    "    memset(&sa, 0, sizeof(sa));",
+    "    sa.sa_handler = bf_on_alarm;",
+    "    sigemptyset(&sa.sa_mask);",
+    "    sigaction(SIGALRM, &sa, NULL);",
+    "    memset(&timer, 0, sizeof(timer));",
+    "    timer.it_value.tv_sec = (time_t)(BF_TIMEOUT_USEC / 1000000);",
+    "    timer.it_value.tv_usec = (suseconds_t)(BF_TIMEOUT_USEC % 1000000);",
+    "    setitimer(ITIMER_REAL, &timer, NULL);",
+    "#endif",
+    "}",
+    NULL
+};
+
+// Checkpoints of a long-running program. The signal handlers only set a
+// flag; the state is saved at the next loop back edge that checks it, where
+// the position in the program is just the number of the loop.
+const char *const CHECKPOINT_RUNTIME[] = {
+    "#define BF_CHECKPOINT_MAGIC \"bf2c-checkpoint 1\"",
+    "#if defined(__GNUC__)",
+    "#define BF_SAFEPOINT(n) if (__builtin_expect(bf_checkpoint_requested, 0)) bf_checkpoint(n, array, ptr)",
+    "#define BF_CHECKPOINT_PATH __attribute__((cold))",
+    "#else",
+    "#define BF_SAFEPOINT(n) if (bf_checkpoint_requested) bf_checkpoint(n, array, ptr)",
+    "#define BF_CHECKPOINT_PATH",
+    "#endif",
+    "",
+    "static volatile sig_atomic_t bf_checkpoint_requested;",
+    "",
+    "static void bf_on_checkpoint_signal(int sig) {",
+    "    (void)sig;",
+    "    bf_checkpoint_requested = 1;",
+    "}",
+    "",
+    "/* Writes the state to BF_CHECKPOINT_FILE through a temporary file, so that",
+    " * a crash while saving leaves the previous checkpoint intact. The output",
+    " * still in the buffer is saved with the tape rather than written. */",
+    "static inline BF_CHECKPOINT_PATH void bf_checkpoint(int loop, const unsigned char *array, const unsigned char *ptr) {",
+    "    char tmp[4096];",
+    "    size_t used = TAPE_SIZE;",
+    "    FILE *fp;",
+    "    int failed;",
+    "    bf_checkpoint_requested = 0;",
+    "    while (used > 0 && array[used - 1] == 0) {",
+    "        used--;",
+    "    }",
+    "    snprintf(tmp, sizeof(tmp), \"%s.tmp\", BF_CHECKPOINT_FILE);",
+    "    fp = fopen(tmp, \"wb\");",
+    "    if (!fp) {",
+    "        perror(tmp);",
+    "        return;",
+    "    }",
+    "    fprintf(fp, BF_CHECKPOINT_MAGIC \"\\nchecksum %08lx\\nloop %d\\nptr %ld\\ninput %llu\\noutput %llu\\npending %lu\\ntape %lu\\n\",",
+    "            BF_PROGRAM_CHECKSUM, loop, (long)(ptr - array), bf_in_total - (bf_in_len - bf_in_pos),",
+    "            bf_out_total, (unsigned long)bf_out_len, (unsigned long)used);",
+    "    fwrite(bf_out, 1, bf_out_len, fp);",
+    "    fwrite(array, 1, used, fp);",
+    "    failed = fflush(fp) != 0 || ferror(fp) || fsync(fileno(fp)) != 0;",
+    "    if (fclose(fp) != 0 || failed || rename(tmp, BF_CHECKPOINT_FILE) != 0) {",
+    "        perror(BF_CHECKPOINT_FILE);",
+    "        remove(tmp);",
+    "    }",
+    "}",
+    "",
+    "/* Loads a checkpoint and returns one more than the number of the loop to",
+    " * resume in. Input the program had consumed is skipped, so standard input",
+    " * must be the same as in the run that saved it. */",
+    "static inline int bf_restore(const char *path, unsigned char *array, unsigned char **ptr) {",
+    "    unsigned long checksum, pending, used;",
+    "    unsigned long long input, output;",
+    "    long offset;",
+    "    int loop;",
+    "    FILE *fp = fopen(path, \"rb\");",
+    "    if (!fp) {",
+    "        perror(path);",
+    "        exit(EXIT_FAILURE);",
+    "    }",
+    "    if (fscanf(fp, BF_CHECKPOINT_MAGIC \" checksum %lx loop %d ptr %ld input %llu output %llu pending %lu tape %lu\",",
+    "               &checksum, &loop, &offset, &input, &output, &pending, &used) != 7 || fgetc(fp) != '\\n' ||",
+    "        loop < 0 || offset < 0 || offset >= TAPE_SIZE || pending > BF_IO_BUFFER || used > TAPE_SIZE ||",
+    "        fread(bf_out, 1, pending, fp) != pending || fread(array, 1, used, fp) != used) {",
+    "        fprintf(stderr, \"%s: not a valid checkpoint\\n\", path);",
+    "        exit(EXIT_FAILURE);",
+    "    }",
+    "    fclose(fp);",
+    "    if (checksum != BF_PROGRAM_CHECKSUM) {",
+    "        fprintf(stderr, \"%s: checkpoint of a different program\\n\", path);",
+    "        exit(EXIT_FAILURE);",
+    "    }",
+    "    bf_out_len = pending;",
+    "    bf_out_total = output;",
+    "    *ptr = array + offset;",
+    "    if (input > 0 && lseek(0, (off_t)input, SEEK_CUR) != (off_t)-1) {",
+    "        bf_in_total = input;",
+    "    } else {",
+    "        while (input > 0 && bf_getc() != EOF) {",
+    "            input--;",
+    "        }",
+    "    }",
+    "    return loop + 1;",
+    "}",
+    "",
+    "/* Restores the checkpoint named on the command line, if any, and installs",
+    " * the handlers that request new ones. */",
+    "static inline int bf_checkpoint_init(int argc, char *argv[], unsigned char *array, unsigned char **ptr) {",
+    "    struct sigaction sa;",
+    "    int resume = 0, i;",
+    "    for (i = 1; i < argc; i++) {",
+    "        if (strcmp(argv[i], \"--restore\") == 0) {",
+    "            resume = bf_restore(BF_CHECKPOINT_FILE, array, ptr);",
+    "        } else if (strncmp(argv[i], \"--restore=\", 10) == 0) {",
+    "            resume = bf_restore(argv[i] + 10, array, ptr);",
+    "        } else {",
+    "            fprintf(stderr, \"Usage: %s [--restore[=FILE]]\\n\", argv[0]);",
+    "            exit(EXIT_FAILURE);",
+    "        }",
+    "    }",
+    "    memset(&sa, 0, sizeof(sa));",
+    "    sa.sa_handler = bf_on_checkpoint_signal;",
+    "    sa.sa_flags = SA_RESTART;",
+    "    sigemptyset(&sa.sa_mask);",
+    "    sigaction(SIGUSR1, &sa, NULL);",
+    "#if BF_CHECKPOINT_INTERVAL_USEC",
+    "    {",
+    "        struct itimerval timer;",
+    "        sigaction(SIGVTALRM, &sa, NULL);",
+    "        timer.it_value.tv_sec = (time_t)(BF_CHECKPOINT_INTERVAL_USEC / 1000000);",
+    "        timer.it_value.tv_usec = (suseconds_t)(BF_CHECKPOINT_INTERVAL_USEC % 1000000);",
+    "        timer.it_interval = timer.it_value;",
+    "        setitimer(ITIMER_VIRTUAL, &timer, NULL);",
+    "    }",
+    "#endif",
+    "    return resume;",
+    "}",
+    NULL
+};
+
+// Bulk copy used by lowered copy loops such as ",[.,]".
+const char *const COPY_RUNTIME[] = {
+    "#if defined(__linux__)",
+    "/* Copies from a regular file on standard input without reading it into the",
+    " * process: the file is scanned through a mapping and sent with sendfile().",
+    " * Returns 0 if standard input is not a regular file. */",
+    "static inline int bf_copy_file_until(int stop, int *result) {",
+    "    struct stat st;",
+    "    off_t off, page = (off_t)sysconf(_SC_PAGESIZE);",
+    "    if (bf_in_pos != bf_in_len || bf_in_eof || fstat(0, &st) != 0 || !S_ISREG(st.st_mode)) {",
+    "        return 0;",
+    "    }",
+    "    off = lseek(0, 0, SEEK_CUR);",
+    "    if (off < 0) {",
+    "        return 0;",
+    "    }",
+    "    bf_flush();",
+    "    while (off < st.st_size) {",
+    "        off_t base = off - off % page;",
+    "        size_t span = (size_t)(st.st_size - base) < BF_MAP_CHUNK ? (size_t)(st.st_size - base) : BF_MAP_CHUNK;",
+    "        unsigned char *map = mmap(NULL, span, PROT_READ, MAP_PRIVATE, 0, base);",
+    "        const unsigned char *start, *hit;",
+    "        size_t len, sent = 0;",
+    "        if (map == MAP_FAILED) {",
+    "            return 0;",
+    "        }",
+    "        start = map + (off - base);",
+    "        hit = memchr(start, stop, span - (size_t)(off - base));",
+    "        len = hit ? (size_t)(hit - start) : span - (size_t)(off - base);",
+    "        while (sent < len) {",
+    "            off_t from = off + (off_t)sent;",
+    "            ssize_t n = sendfile(1, 0, &from, len - sent);",
+    "            if (n <= 0) {",
+    "                bf_write_all(start + sent, len - sent);",
+    "                break;",
+    "            }",
+    "            sent += (size_t)n;",
+    "        }",
+    "        off += (off_t)len + (hit ? 1 : 0);",
+    "        munmap(map, span);",
+    "        lseek(0, off, SEEK_SET);",
+    "        if (hit) {",
+    "            *result = stop;",
+    "            return 1;",
+    "        }",
+    "    }",
+    "    bf_in_eof = 1;",
+    "    *result = EOF;",
+    "    return 1;",
+    "}",
+    "#endif",
+    "",
+    "/* Copies input to output until the byte stop is read, which is consumed but",
+    " * not written. Returns stop, or EOF if the input ends first. */",
+    "static inline int bf_copy_until(int stop) {",
+    "    for (;;) {",
+    "        const unsigned char *start, *hit;",
+    "        size_t avail;",
+    "        if (bf_in_pos == bf_in_len) {",
+    "#if defined(__linux__)",
+    "            int result;",
+    "            if (bf_copy_file_until(stop, &result)) {",
+    "                return result;",
+    "            }",
+    "#endif",
+    "            if (!bf_fill()) {",
+    "                return EOF;",
+    "            }",
+    "        }",
+    "        start = bf_in + bf_in_pos;",
+    "        avail = bf_in_len - bf_in_pos;",
+    "        hit = memchr(start, stop, avail);",
+    "        if (hit) {",
+    "            bf_put_block(start, (size_t)(hit - start));",
+    "            bf_in_pos += (size_t)(hit - start) + 1;",
+    "            return stop;",
+    "        }",
+    "        bf_put_block(start, avail);",
+    "        bf_in_pos = bf_in_len;",
+    "    }",
+    "}",
+    NULL
+};
+
+// Bulk filter used by lowered stream filter loops such as ",[+.,]".
+const char *const TRANSFORM_RUNTIME[] = {
+    "/* Writes each input byte through map, or adds add to it when map is NULL,",
+    " * until the byte stop is read, which is consumed but not written. Returns",
+    " * stop, or EOF if the input ends first. The stop byte is found with memchr()",
+    " * and the bytes before it are transformed a block at a time; the addition",
+    " * form vectorizes. */",
+    "static inline int bf_transform_until(const unsigned char *map, int add, int stop) {",
+    "    for (;;) {",
+    "        const unsigned char *start, *hit;",
+    "        size_t avail, len, i;",
+    "        if (bf_in_pos == bf_in_len && !bf_fill()) {",
+    "            return EOF;",
+    "        }",
+    "        start = bf_in + bf_in_pos;",
+    "        avail = bf_in_len - bf_in_pos;",
+    "        hit = memchr(start, stop, avail);",
+    "        len = hit ? (size_t)(hit - start) : avail;",
+    "        bf_in_pos += hit ? len + 1 : len;",
+    "        while (len > 0) {",
+    "            size_t room = BF_IO_BUFFER - bf_out_len, chunk = len < room ? len : room;",
+    "            unsigned char *out = bf_out + bf_out_len;",
+    "            if (map) {",
+    "                for (i = 0; i < chunk; i++) {",
+    "                    out[i] = map[start[i]];",
+    "                }",
+    "            } else {",
+    "                for (i = 0; i < chunk; i++) {",
+    "                    out[i] = (unsigned char)(start[i] + add);",
+    "                }",
+    "            }",
+    "            bf_out_len += chunk;",
+    "            start += chunk;",
+    "            len -= chunk;",
+    "            if (bf_out_len == BF_IO_BUFFER || bf_out_tty) {",
+    "                bf_flush();",
+    "            }",
+    "        }",
+    "        if (hit) {",
+    "            return stop;",
+    "        }",
+    "    }",
+    "}",
+    NULL
+};
+
+/*
+ * generate_transform_tables()
+ *
+ * Prints the lookup table of every stream filter loop.
+ */
+void generate_transform_tables(void) {
+    for (int i = 0; i < numLoops; i++) {
+        if (!loopInfo[i].map) {
+            continue;
+        }
+        printf("static const unsigned char bf_map_%d[256] = {", i);
+        for (int byte = 0; byte < 256; byte++) {
+            printf("%s%d%s", byte % 16 == 0 ? "\n    " : "", loopInfo[i].map[byte], byte < 255 ? ", " : "");
+        }
+        printf("\n};\n\n");
+    }
+}
+
+// Session state and I/O of a --resumable program.
+const char *const SESSION_RUNTIME[] = {
+    "#define BF_SESSION_OUTPUT 4096",
+    "",
+    "enum { BF_DONE, BF_NEED_INPUT };",
+    "",
+    "typedef void (*bf_write_fn)(void *ctx, const unsigned char *data, size_t len);",
+    "",
+    "/* One running instance of the program. Sessions are independent, so any",
+    " * number of them can be driven from one thread. */",
+    "typedef struct {",
+    "    unsigned char tape[TAPE_SIZE];",
+    "    size_t ptr;",
+    "    int state;",
+    "    const unsigned char *in;",
+    "    size_t in_len, in_pos;",
+    "    int in_eof;",
+    "    bf_write_fn write;",
+    "    void *ctx;",
+    "    unsigned char out[BF_SESSION_OUTPUT];",
+    "    size_t out_len;",
+    "} bf_session;",
+    "",
+    "void bf_session_init(bf_session *s, bf_write_fn write, void *ctx) {",
+    "    memset(s, 0, sizeof *s);",
+    "    s->write = write;",
+    "    s->ctx = ctx;",
+    "}",
+    "",
+    "static inline void bf_session_flush(bf_session *s) {",
+    "    if (s->out_len > 0) {",
+    "        s->write(s->ctx, s->out, s->out_len);",
+    "        s->out_len = 0;",
+    "    }",
+    "}",
+    "",
+    "static inline void bf_session_putc(bf_session *s, int c) {",
+    "    s->out[s->out_len++] = (unsigned char)c;",
+    "    if (s->out_len == BF_SESSION_OUTPUT) {",
+    "        bf_session_flush(s);",
+    "    }",
+    "}",
+    "",
+    "/* Reads one byte, or suspends the session at resume point k when the input",
+    " * given to bf_session_resume() is used up and more may follow. */",
+    "#define BF_SESSION_READ(k) \\",
+    "    bf_input_##k: \\",
+    "    if (s->in_pos == s->in_len && !s->in_eof) { \\",
+    "        s->state = (k); \\",
+    "        s->ptr = (size_t)(ptr - s->tape); \\",
+    "        bf_session_flush(s); \\",
+    "        return BF_NEED_INPUT; \\",
+    "    } \\",
+    "    *ptr = s->in_pos < s->in_len ? s->in[s->in_pos++] : (unsigned char)EOF",
+    NULL
+};
+
+// Default driver of a --resumable program: one session fed from stdin.
+const char *const SESSION_MAIN[] = {
+    "#ifndef BF_NO_MAIN",
+    "static void bf_stdout_write(void *ctx, const unsigned char *data, size_t len) {",
+    "    (void)ctx;",
+    "    fwrite(data, 1, len, stdout);",
+    "    fflush(stdout);",
+    "}",
+    "",
+    "int main(void) {",
+    "    static bf_session session;",
+    "    unsigned char buffer[4096];",
+    "    size_t len = 0;",
+    "    int eof = 0;",
+    "",
+    "    bf_session_init(&session, bf_stdout_write, NULL);",
+    "    while (bf_session_resume(&session, buffer, len, eof) == BF_NEED_INPUT) {",
+    "#if BF_POSIX_IO",
+    "        ssize_t n = read(0, buffer, sizeof buffer);",
+    "        len = n > 0 ? (size_t)n : 0;",
+    "#else",
+    "        int c = getchar();",
+    "        buffer[0] = (unsigned char)c;",
+    "        len = c == EOF ? 0 : 1;",
+    "#endif",
+    "        eof = len == 0;",
+    "    }",
+    "    return 0;",
+    "}",
+    "#endif",
+    NULL
+};
+
+// Stage I/O of a --pipeline program: rings between threads.
+const char *const PIPELINE_RUNTIME[] = {
+    "#ifndef BF_RING_SIZE",
+    "#define BF_RING_SIZE 65536",
+    "#endif",
+    "#ifndef BF_RING_BATCH",
+    "#define BF_RING_BATCH (BF_RING_SIZE < 4096 ? BF_RING_SIZE : 4096)",
+    "#endif",
+    "",
+    "/* Single-producer/single-consumer byte queue between two stages. Each side",
+    " * works on its private position and publishes it to the other side in",
+    " * batches, and before it blocks. A side that finds the queue empty or full",
+    " * sleeps on the condition variable; the other side only takes the lock when",
+    " * that side's waiting flag says it is asleep. Each side has its own flag,",
+    " * as both can be on their way to sleep at once. */",
+    "typedef struct {",
+    "    _Atomic size_t head;",
+    "    size_t write_pos;",
+    "    unsigned char data[BF_RING_SIZE];",
+    "    _Atomic size_t tail;",
+    "    size_t read_pos;",
+    "    _Atomic int closed;",
+    "    _Atomic int space_waiting;  /* The writer waits for space */",
+    "    _Atomic int data_waiting;   /* The reader waits for data */",
+    "    pthread_mutex_t lock;",
+    "    pthread_cond_t cond;",
+    "} bf_ring;",
+    "",
+    "typedef struct {",
+    "    bf_ring *in;    /* NULL: standard input */",
+    "    bf_ring *out;   /* NULL: standard output */",
+    "} bf_stage;",
+    "",
+    "static inline void bf_ring_init(bf_ring *r) {",
+    "    pthread_mutex_init(&r->lock, NULL);",
+    "    pthread_cond_init(&r->cond, NULL);",
+    "}",
+    "",
+    "static inline void bf_ring_wake(bf_ring *r, _Atomic int *waiting) {",
+    "    if (atomic_load(waiting)) {",
+    "        pthread_mutex_lock(&r->lock);",
+    "        pthread_cond_broadcast(&r->cond);",
+    "        pthread_mutex_unlock(&r->lock);",
+    "    }",
+    "}",
+    "",
+    "static inline void bf_ring_publish_head(bf_ring *r) {",
+    "    if (atomic_load_explicit(&r->head, memory_order_relaxed) != r->write_pos) {",
+    "        atomic_store(&r->head, r->write_pos);",
+    "        bf_ring_wake(r, &r->data_waiting);",
+    "    }",
+    "}",
+    "",
+    "static inline void bf_ring_publish_tail(bf_ring *r) {",
+    "    if (atomic_load_explicit(&r->tail, memory_order_relaxed) != r->read_pos) {",
+    "        atomic_store(&r->tail, r->read_pos);",
+    "        bf_ring_wake(r, &r->space_waiting);",
+    "    }",
+    "}",
+    "",
+    "static inline void bf_ring_wait_space(bf_ring *r) {",
+    "    pthread_mutex_lock(&r->lock);",
+    "    atomic_store(&r->space_waiting, 1);",
+    "    while (r->write_pos - atomic_load(&r->tail) == BF_RING_SIZE) {",
+    "        pthread_cond_wait(&r->cond, &r->lock);",
+    "    }",
+    "    atomic_store(&r->space_waiting, 0);",
+    "    pthread_mutex_unlock(&r->lock);",
+    "}",
+    "",
+    "static inline void bf_ring_wait_data(bf_ring *r) {",
+    "    pthread_mutex_lock(&r->lock);",
+    "    atomic_store(&r->data_waiting, 1);",
+    "    while (r->read_pos == atomic_load(&r->head) && !atomic_load(&r->closed)) {",
+    "        pthread_cond_wait(&r->cond, &r->lock);",
+    "    }",
+    "    atomic_store(&r->data_waiting, 0);",
+    "    pthread_mutex_unlock(&r->lock);",
+    "}",
+    "",
+    "static inline void bf_stage_publish(bf_stage *st) {",
+    "    if (st->out) {",
+    "        bf_ring_publish_head(st->out);",
+    "    } else {",
+    "        bf_flush();",
+    "    }",
+    "}",
+    "",
+    "static inline void bf_stage_putc(bf_stage *st, int c) {",
+    "    bf_ring *r = st->out;",
+    "    if (!r) {",
+    "        bf_putc(c);",
+    "        return;",
+    "    }",
+    "    if (r->write_pos - atomic_load_explicit(&r->tail, memory_order_acquire) == BF_RING_SIZE) {",
+    "        bf_ring_publish_head(r);",
+    "        bf_ring_wait_space(r);",
+    "    }",
+    "    r->data[r->write_pos % BF_RING_SIZE] = (unsigned char)c;",
+    "    r->write_pos++;",
+    "    if (r->write_pos - atomic_load_explicit(&r->head, memory_order_relaxed) >= BF_RING_BATCH) {",
+    "        bf_ring_publish_head(r);",
+    "    }",
+    "}",
+    "",
+    "static inline int bf_stage_getc(bf_stage *st) {",
+    "    bf_ring *r = st->in;",
+    "    int c;",
+    "    if (!r) {",
+    "        if (bf_in_pos == bf_in_len) {",
+    "            bf_stage_publish(st);",
+    "        }",
+    "        return bf_getc();",
+    "    }",
+    "    if (r->read_pos == atomic_load_explicit(&r->head, memory_order_acquire)) {",
+    "        bf_ring_publish_tail(r);",
+    "        bf_stage_publish(st);",
+    "        bf_ring_wait_data(r);",
+    "        if (r->read_pos == atomic_load(&r->head)) {",
+    "            return EOF;",
+    "        }",
+    "    }",
+    "    c = r->data[r->read_pos % BF_RING_SIZE];",
+    "    r->read_pos++;",
+    "    if (r->read_pos - atomic_load_explicit(&r->tail, memory_order_relaxed) >= BF_RING_BATCH) {",
+    "        bf_ring_publish_tail(r);",
+    "    }",
+    "    return c;",
+    "}",
+    "",
+    "/* Called when a stage's program ends: its reader sees end of input once the",
+    " * remaining bytes are consumed. */",
+    "static inline void bf_stage_finish(bf_stage *st) {",
+    "    if (st->out) {",
+    "        bf_ring_publish_head(st->out);",
+    "        pthread_mutex_lock(&st->out->lock);",
+    "        atomic_store(&st->out->closed, 1);",
+    "        pthread_cond_broadcast(&st->out->cond);",
+    "        pthread_mutex_unlock(&st->out->lock);",
+    "    } else {",
+    "        bf_flush();",
+    "    }",
+    "}",
+    NULL
+};
+
+// Lockstep runtime of a --batch program. The tape is stored lane-major,
+// so the cells of all instances at one position are adjacent and a cell
+// update is one masked vector operation over BF_LANES bytes.
+const char *const BATCH_RUNTIME[] = {
+    "#ifndef BF_LANES",
+    "#define BF_LANES 16",
+    "#endif",
+    "/* Below this many running lanes, a divergent batch finishes lane by lane. */",
+    "#ifndef BF_MIN_ACTIVE",
+    "#define BF_MIN_ACTIVE (BF_LANES / 4)",
+    "#endif",
+    "",
+    "typedef struct {",
+    "    unsigned char *in;",
+    "    size_t in_len, in_pos;",
+    "    unsigned char *out;",
+    "    size_t out_len, out_cap;",
+    "    int failed;",
+    "} bf_lane;",
+    "",
+    "static unsigned char bf_batch_tape[TAPE_SIZE * BF_LANES];",
+    "static unsigned char bf_lane_tape[TAPE_SIZE];",
+    "",
+    "static inline void bf_lane_putc(bf_lane *l, unsigned char c) {",
+    "    if (l->out_len == l->out_cap) {",
+    "        l->out_cap = l->out_cap ? l->out_cap * 2 : 4096;",
+    "        l->out = realloc(l->out, l->out_cap);",
+    "        if (!l->out) {",
+    "            perror(\"realloc\");",
+    "            exit(EXIT_FAILURE);",
+    "        }",
+    "    }",
+    "    l->out[l->out_len++] = c;",
+    "}",
+    "",
+    "static inline unsigned char bf_lane_getc(bf_lane *l) {",
+    "    return l->in_pos < l->in_len ? l->in[l->in_pos++] : (unsigned char)EOF;",
+    "}",
+    "",
+    "/* Runs one instance from pc to the end of the program on its own tape. */",
+    "static void bf_run_lane(const bf_insn *pc, unsigned char *ptr, bf_lane *l) {",
+    "    int i;",
+    "    for (;; pc++) {",
+    "        switch (pc->op) {",
+    "            case BC_ADD: *ptr += pc->arg; break;",
+    "            case BC_MOVE: ptr += pc->arg; break;",
+    "            case BC_OUTPUT: for (i = 0; i < pc->arg; i++) bf_lane_putc(l, *ptr); break;",
+    "            case BC_INPUT: for (i = 0; i < pc->arg; i++) *ptr = bf_lane_getc(l); break;",
+    "            case BC_JUMP_ZERO: if (!*ptr) pc = bf_code + pc->arg; break;",
+    "            case BC_JUMP_NONZERO: if (*ptr) pc = bf_code + pc->arg; break;",
+    "            default: return;",
+    "        }",
+    "    }",
+    "}",
+    "",
+    "/*",
+    " * Runs up to BF_LANES instances in lockstep with one shared pointer. A lane",
+    " * whose loop ends before the others' is parked at the loop's last jump",
+    " * and resumes when the rest leave the loop; that keeps the pointer shared",
+    " * only for balanced loops, so a lane diverging on any other loop, or too",
+    " * few lanes left running, sends every lane to bf_run_lane().",
+    " */",
+    "static void bf_run_batch(bf_lane *lanes, int n) {",
+    "    unsigned char mask[BF_LANES];",
+    "    int parked[BF_LANES];",
+    "    long parked_cell[BF_LANES];",
+    "    const bf_insn *pc = bf_code;",
+    "    long cell = 0;",
+    "    int active = n, l, i;",
+    "",
+    "    memset(bf_batch_tape, 0, sizeof(bf_batch_tape));",
+    "    for (l = 0; l < BF_LANES; l++) {",
+    "        mask[l] = l < n ? 0xFF : 0;",
+    "        parked[l] = -1;",
+    "    }",
+    "    for (;; pc++) {",
+    "        unsigned char *row = bf_batch_tape + cell * BF_LANES;",
+    "        int taken, end;",
+    "        switch (pc->op) {",
+    "            case BC_ADD:",
+    "                for (l = 0; l < BF_LANES; l++) {",
+    "                    row[l] += (unsigned char)pc->arg & mask[l];",
+    "                }",
+    "                break;",
+    "            case BC_MOVE:",
+    "                cell += pc->arg;",
+    "                break;",
+    "            case BC_OUTPUT:",
+    "                for (l = 0; l < n; l++) {",
+    "                    for (i = 0; mask[l] && i < pc->arg; i++) {",
+    "                        bf_lane_putc(&lanes[l], row[l]);",
+    "                    }",
+    "                }",
+    "                break;",
+    "            case BC_INPUT:",
+    "                for (l = 0; l < n; l++) {",
+    "                    for (i = 0; mask[l] && i < pc->arg; i++) {",
+    "                        row[l] = bf_lane_getc(&lanes[l]);",
+    "                    }",
+    "                }",
+    "                break;",
+    "            case BC_JUMP_ZERO:",
+    "            case BC_JUMP_NONZERO:",
+    "                taken = 0;",
+    "                for (l = 0; l < BF_LANES; l++) {",
+    "                    taken += (row[l] & mask[l]) != 0;",
+    "                }",
+    "                end = pc->op == BC_JUMP_ZERO ? pc->arg : (int)(pc - bf_code);",
+    "                if (taken > 0 && taken < active) {",
+    "                    if (!bf_balanced[end] || taken < BF_MIN_ACTIVE) {",
+    "                        for (l = 0; l < n; l++) {",
+    "                            const bf_insn *from = mask[l] ? pc : bf_code + parked[l] + 1;",
+    "                            long at = mask[l] ? cell : parked_cell[l];",
+    "                            for (i = 0; i < TAPE_SIZE; i++) {",
+    "                                bf_lane_tape[i] = bf_batch_tape[(long)i * BF_LANES + l];",
+    "                            }",
+    "                            bf_run_lane(from, bf_lane_tape + at, &lanes[l]);",
+    "                        }",
+    "                        return;",
+    "                    }",
+    "                    for (l = 0; l < BF_LANES; l++) {",
+    "                        if (mask[l] && !row[l]) {",
+    "                            mask[l] = 0;",
+    "                            parked[l] = end;",
+    "                            parked_cell[l] = cell;",
+    "                        }",
+    "                    }",
+    "                    active = taken;",
+    "                }",
+    "                if (taken > 0) {",
+    "                    if (pc->op == BC_JUMP_NONZERO) {",
+    "                        pc = bf_code + pc->arg;",
+    "                    }",
+    "                } else {",
+    "                    for (l = 0; l < BF_LANES; l++) {",
+    "                        if (parked[l] == end) {",
+    "                            mask[l] = 0xFF;",
+    "                            parked[l] = -1;",
+    "                            active++;",
+    "                        }",
+    "                    }",
+    "                    pc = bf_code + end;",
+    "                }",
+    "                break;",
+    "            default:",
+    "                return;",
+    "        }",
+    "    }",
+    "}",
+    "",
+    "static void bf_lane_load(bf_lane *l, const char *path) {",
+    "    FILE *fp = fopen(path, \"rb\");",
+    "    size_t cap = 0, n;",
+    "    if (!fp) {",
+    "        perror(path);",
+    "        l->failed = 1;",
+    "        return;",
+    "    }",
+    "    do {",
+    "        if (l->in_len == cap) {",
+    "            cap = cap ? cap * 2 : 4096;",
+    "            l->in = realloc(l->in, cap);",
+    "            if (!l->in) {",
+    "                perror(\"realloc\");",
+    "                exit(EXIT_FAILURE);",
+    "            }",
+    "        }",
+    "        n = fread(l->in + l->in_len, 1, cap - l->in_len, fp);",
+    "        l->in_len += n;",
+    "    } while (n > 0);",
+    "    fclose(fp);",
+    "}",
+    "",
+    "static int bf_lane_save(bf_lane *l, const char *path) {",
+    "    size_t len = strlen(path);",
+    "    char *name = malloc(len + 5);",
+    "    FILE *fp;",
+    "    int ok;",
+    "    if (!name) {",
+    "        perror(\"malloc\");",
+    "        exit(EXIT_FAILURE);",
+    "    }",
+    "    memcpy(name, path, len);",
+    "    memcpy(name + len, \".out\", 5);",
+    "    fp = fopen(name, \"wb\");",
+    "    ok = fp && fwrite(l->out, 1, l->out_len, fp) == l->out_len;",
+    "    if (fp && fclose(fp) != 0) {",
+    "        ok = 0;",
+    "    }",
+    "    if (!ok) {",
+    "        perror(name);",
+    "    }",
+    "    free(name);",
+    "    return ok;",
+    "}",
+    "",
+    "int main(int argc, char *argv[]) {",
+    "    static bf_lane lanes[BF_LANES];",
+    "    int first, l, n, status = 0;",
+    "    for (first = 1; first < argc; first += n) {",
+    "        n = argc - first < BF_LANES ? argc - first : BF_LANES;",
+    "        memset(lanes, 0, sizeof(lanes));",
+    "        for (l = 0; l < n; l++) {",
+    "            bf_lane_load(&lanes[l], argv[first + l]);",
+    "        }",
+    "        bf_run_batch(lanes, n);",
+    "        for (l = 0; l < n; l++) {",
+    "            if (lanes[l].failed || !bf_lane_save(&lanes[l], argv[first + l])) {",
+    "                status = EXIT_FAILURE;",
+    "            }",
+    "            free(lanes[l].in);",
+    "            free(lanes[l].out);",
+    "        }",
+    "    }",
+    "    return status;",
+    "}",
+    NULL
+};
+
+/*
+ * print_lines()
+ *
+ * Prints a NULL-terminated array of source lines.
+ */
+void print_lines(const char *const *lines) {
+    for (; *lines; lines++) {
+        printf("%s\n", *lines);
+    }
+}
+
+/*
+ * print_c_string()
+ *
+ * Prints a string as a C string literal.
+ */
+void print_c_string(const char *str) {
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            putchar('\\');
+        }
+        putchar(*str);
+    }
+    putchar('"');
+}
+
+/*
+ * generate_profile_runtime()
+ *
+ * Prints the counters of an instrumented build and the exit handler that
+ * writes them to the profile file.
+ */
+void generate_profile_runtime(void) {
+    int size = numLoops > 0 ? numLoops : 1;
+    printf("static unsigned long long bf_prof_entries[%d];\n", size);
+    printf("static unsigned long long bf_prof_iters[%d];\n", size);
+    if (numValueSlots > 0) {
+        printf("static unsigned long long bf_prof_values[%d][256];\n", numValueSlots);
+        printf("static const int bf_prof_value_loops[%d] = {", numValueSlots);
+        for (int i = 0, n = 0; i < numLoops; i++) {
+            if (loopInfo[i].valueSlot >= 0) {
+                printf("%s%d", n++ ? ", " : "", i);
+            }
+        }
+        printf("};\n");
+    }
+    printf("\n");
+    printf("static void bf_prof_write(void) {\n");
+    printf("    FILE *fp = fopen(");
+    print_c_string(options.profileGenerate);
+    printf(", \"w\");\n");
+    printf("    int i%s;\n", numValueSlots > 0 ? ", v" : "");
+    printf("    if (!fp) {\n");
+    printf("        perror(\"bf_prof_write\");\n");
+    printf("        return;\n");
+    printf("    }\n");
+    printf("    fprintf(fp, \"%s %d\\nchecksum %%08lx\\nloops %d\\n\", %#lxUL);\n",
+           PROFILE_MAGIC, PROFILE_VERSION, numLoops, programChecksum);
+    printf("    for (i = 0; i < %d; i++) {\n", numLoops);
+    printf("        fprintf(fp, \"loop %%d %%llu %%llu\\n\", i, bf_prof_entries[i], bf_prof_iters[i]);\n");
+    printf("    }\n");
+    if (numValueSlots > 0) {
+        printf("    for (i = 0; i < %d; i++) {\n", numValueSlots);
+        printf("        for (v = 0; v < 256; v++) {\n");
+        printf("            if (bf_prof_values[i][v]) {\n");
+        printf("                fprintf(fp, \"value %%d %%d %%llu\\n\", bf_prof_value_loops[i], v, bf_prof_values[i][v]);\n");
+        printf("            }\n");
+        printf("        }\n");
+        printf("    }\n");
+    }
+    printf("    fclose(fp);\n");
+    printf("}\n\n");
+}
+
+/*
+ * generate_memo_runtime()
+ *
+ * Prints the run-time cache used by memoized loops. Each loop has a small
+ * direct-mapped table keyed on the contents of its window at entry. A loop
+ * whose hit rate over a probation period stays below BF_MEMO_MIN_HITS
+ * percent stops using its table for the rest of the run. The rate is
+ * judged once, on the lookup after the last one of the probation, whether
+ * that last one hit or missed.
+ */
+void generate_memo_runtime(void) {
+    printf("#define BF_MEMO_WINDOW %d\n", MEMO_WINDOW);
+    printf("#define BF_MEMO_SLOTS 64\n");
+    printf("#define BF_MEMO_PROBATION 256\n");
+    printf("#define BF_MEMO_MIN_HITS 25\n\n");
+    printf("typedef struct {\n");
+    printf("    unsigned char key[BF_MEMO_WINDOW];\n");
+    printf("    unsigned char value[BF_MEMO_WINDOW];\n");
+    printf("    unsigned char valid;\n");
+    printf("} bf_memo_entry;\n\n");
+    printf("typedef struct {\n");
+    printf("    bf_memo_entry entries[BF_MEMO_SLOTS];\n");
+    printf("    unsigned long lookups, hits;\n");
+    printf("    int disabled;\n");
+    printf("} bf_memo_table;\n\n");
+    printf("static bf_memo_table bf_memo[%d];\n\n", numMemoSlots);
+    printf("static bf_memo_entry *bf_memo_entry_for(bf_memo_table *t, const unsigned char *w, int n) {\n");
+    printf("    unsigned hash = 2166136261u;\n");
+    printf("    int i;\n");
+    printf("    for (i = 0; i < n; i++) {\n");
+    printf("        hash = (hash ^ w[i]) * 16777619u;\n");
+    printf("    }\n");
+    printf("    return &t->entries[(hash ^ (hash >> 16)) %% BF_MEMO_SLOTS];\n");
+    printf("}\n\n");
+    printf("static int bf_memo_replay(bf_memo_table *t, unsigned char *w, int n) {\n");
+    printf("    bf_memo_entry *e;\n");
+    printf("    if (t->disabled) {\n");
+    printf("        return 0;\n");
+    printf("    }\n");
+    printf("    if (t->lookups == BF_MEMO_PROBATION && t->hits * 100 < t->lookups * BF_MEMO_MIN_HITS) {\n");
+    printf("        t->disabled = 1;\n");
+    printf("        return 0;\n");
+    printf("    }\n");
+    printf("    e = bf_memo_entry_for(t, w, n);\n");
+    printf("    t->lookups++;\n");
+    printf("    if (e->valid && memcmp(e->key, w, n) == 0) {\n");
+    printf("        memcpy(w, e->value, n);\n");
+    printf("        t->hits++;\n");
+    printf("        return 1;\n");
+    printf("    }\n");
+    printf("    return 0;\n");
+    printf("}\n\n");
+    printf("static void bf_memo_record(bf_memo_table *t, const unsigned char *key, const unsigned char *w, int n) {\n");
+    printf("    bf_memo_entry *e;\n");
+    printf("    if (t->disabled) {\n");
+    printf("        return;\n");
+    printf("    }\n");
+    printf("    e = bf_memo_entry_for(t, key, n);\n");
+    printf("    memcpy(e->key, key, n);\n");
+    printf("    memcpy(e->value, w, n);\n");
+    printf("    e->valid = 1;\n");
+    printf("}\n\n");
+}
+
+/*
+ * output_call()
+ *
+ * Returns the statement that writes the current cell.
+ */
+const char* output_call(void) {
+    if (options.pipeline) {
+        return "bf_stage_putc(st, *ptr)";
+    }
+    return options.resumable ? "bf_session_putc(s, *ptr)" : "bf_putc(*ptr)";
+}
+
+/*
+ * input_call()
+ *
+ * Returns the expression that reads the next input byte.
+ */
+const char* input_call(void) {
+    return options.pipeline ? "bf_stage_getc(st)" : "bf_getc()";
+}
+
+/*
+ * generate_code()
+ *
+ * Recursively traverses the AST and prints out equivalent C code.
+ *
+ * Parameters:
+ *   nodes        - Pointer to the current AST node array.
+ *   numNodes     - Number of nodes at this level.
+ *   indent_level - Current indentation level for pretty printing.
+ */
+void generate_code(ASTNode* nodes, int numNodes, int indent_level) {
+    for (int i = 0; i < numNodes; i++) {
+        ASTNode node = nodes[i];
+        switch (node.type) {
+            case TOKEN_PLUS:
+                print_indent(indent_level);
+                printf("*ptr += %d;\n", node.count);
+                break;
+            case TOKEN_MINUS:
+                print_indent(indent_level);
+                printf("*ptr -= %d;\n", node.count);
+                break;
+            case TOKEN_NEXT:
+                print_indent(indent_level);
+                printf("ptr += %d;\n", node.count);
+                break;
+            case TOKEN_PREVIOUS:
+                print_indent(indent_level);
+                printf("ptr -= %d;\n", node.count);
+                break;
+            case TOKEN_OUTPUT:
+                if (node.count == 1) {
+                    print_indent(indent_level);
+                    printf("%s;\n", output_call());
+                } else {
+                    print_indent(indent_level);
+                    printf("for (int i = 0; i < %d; i++) {\n", node.count);
+                    print_indent(indent_level + 1);
+                    printf("%s;\n", output_call());
+                    print_indent(indent_level);
+                    printf("}\n");
+                }
+                break;
+            case TOKEN_INPUT:
+                if (options.resumable) {
+                    // Every read is a resume point of its own.
+                    for (int r = 0; r < node.count; r++) {
+                        print_indent(indent_level);
+                        printf("BF_SESSION_READ(%d);\n", ++numResumePoints);
+                    }
+                } else if (node.count == 1) {
+                    print_indent(indent_level);
+                    printf("*ptr = %s;\n", input_call());
+                } else {
+                    print_indent(indent_level);
+                    printf("for (int i = 0; i < %d; i++) {\n", node.count);
+                    print_indent(indent_level + 1);
+                    printf("*ptr = %s;\n", input_call());
+                    print_indent(indent_level);
+                    printf("}\n");
+                }
+                break;
+            case TOKEN_LOOP_START:
+                generate_loop(&nodes[i], indent_level);
+                break;
+            case TOKEN_WIDE_ADD:
+                generate_wide_add(&nodes[i], indent_level);
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+/*
+ * generate_governor()
+ *
+ * Prints the limits given on the command line, which can be overridden
+ * when compiling, and the governor that enforces them.
+ */
+void generate_governor(void) {
+    printf("#ifndef BF_MAX_STEPS\n#define BF_MAX_STEPS %lluULL\n#endif\n", options.maxSteps);
+    printf("#ifndef BF_MAX_OUTPUT\n#define BF_MAX_OUTPUT %lluULL\n#endif\n", options.maxOutput);
+    printf("#ifndef BF_TIMEOUT_USEC\n#define BF_TIMEOUT_USEC %lldLL\n#endif\n",
+           (long long)(options.timeout * 1e6 + 0.5));
+    print_lines(GOVERNOR_RUNTIME);
+    printf("\n");
+}
+
+/*
+ * generate_checkpoint()
+ *
+ * Prints the checkpoint settings, which can be overridden when compiling,
+ * and the runtime that saves and restores checkpoints.
+ */
+void generate_checkpoint(void) {
+    printf("#ifndef BF_CHECKPOINT_FILE\n#define BF_CHECKPOINT_FILE ");
+    print_c_string(options.checkpoint);
+    printf("\n#endif\n");
+    printf("#ifndef BF_CHECKPOINT_INTERVAL_USEC\n#define BF_CHECKPOINT_INTERVAL_USEC %lldLL\n#endif\n",
+           (long long)(options.checkpointInterval * 1e6 + 0.5));
+    printf("#define BF_PROGRAM_CHECKSUM 0x%08lxUL\n", programChecksum);
+    print_lines(CHECKPOINT_RUNTIME);
+    printf("\n");
+}
+
+/*
+ * generate_resume_cases()
+ *
+ * Prints a case of the switch at the start of main() for every loop with a
+ * safepoint, jumping into the loop a checkpoint was saved in. Only loops
+ * that generate_while() prints have one: stores hoisted out of a parent
+ * loop, given by its hoisted flags, and the original code of a 16-bit
+ * addition without scratch cells are never printed as loops.
+ */
+void generate_resume_cases(ASTNode* nodes, int numNodes, const unsigned char *hoisted) {
+    for (int i = 0; i < numNodes; i++) {
+        if (hoisted && hoisted[i]) {
+            continue;
+        }
+        if (nodes[i].type == TOKEN_LOOP_START) {
+            if (counted_loop_step(&nodes[i]) == 0) {
+                printf("    case %d: goto bf_resume_%d;\n", nodes[i].id + 1, nodes[i].id);
+            }
+            generate_resume_cases(nodes[i].children, nodes[i].numChildren, loopInfo[nodes[i].id].hoisted);
+        } else if (nodes[i].type == TOKEN_WIDE_ADD && wideOps[nodes[i].id].scratch) {
+            generate_resume_cases(nodes[i].children, nodes[i].numChildren, NULL);
+        }
+    }
+}
+
+/*
+ * generate_includes()
+ *
+ * Prints the system includes the program needs. The shared runtime header
+ * includes everything any program that uses it might need.
+ */
+void generate_includes(int shared) {
+    printf("#if (defined(__unix__) || defined(__APPLE__)) && !defined(_POSIX_C_SOURCE)\n");
+    printf("#define _POSIX_C_SOURCE 200809L\n");
+    printf("#endif\n");
+    printf("#include <stdio.h>\n");
+    printf("#include <stdlib.h>\n");
+    printf("#include <string.h>\n");
+    printf("#if defined(__unix__) || defined(__APPLE__)\n");
+    printf("#include <errno.h>\n");
+    printf("#include <unistd.h>\n");
+    printf("#define BF_POSIX_IO 1\n");
+    printf("#else\n");
+    printf("#define BF_POSIX_IO 0\n");
+    printf("#endif\n");
+    if (options.pipeline) {
+        printf("#include <pthread.h>\n");
+        printf("#include <stdatomic.h>\n");
+    }
+    if (shared || has_limits() || options.checkpoint) {
+        printf("#include <signal.h>\n");
+    }
+    if (shared) {
+        printf("#if BF_POSIX_IO\n");
+        printf("#include <sys/time.h>\n");
+        printf("#endif\n");
+    } else if (options.timeout > 0 || options.checkpoint) {
+        printf("#if BF_POSIX_IO\n");
+        printf("#include <sys/time.h>\n");
+        printf("#else\n");
+        printf("#error \"%s needs setitimer()\"\n", options.checkpoint ? "--checkpoint" : "--timeout");
+        printf("#endif\n");
+    }
+    if (shared || numCopyLoops > 0) {
+        printf("#if defined(__linux__)\n");
+        printf("#include <sys/mman.h>\n");
+        printf("#include <sys/sendfile.h>\n");
+        printf("#include <sys/stat.h>\n");
+        printf("#define BF_MAP_CHUNK ((size_t)16 << 20)\n");
+        printf("#endif\n");
+    }
+}
+
+/*
+ * generate_runtime_header()
+ *
+ * Prints the shared runtime header that programs generated with
+ * --runtime-header include in place of their own copy of the runtime.
+ */
+void generate_runtime_header(void) {
+    printf("/* Shared runtime of programs generated by brainfuck2c --runtime-header. */\n");
+    printf("#ifndef BF2C_RUNTIME_H\n");
+    printf("#define BF2C_RUNTIME_H\n\n");
+    printf("#define BF2C_RUNTIME_VERSION %d\n\n", RUNTIME_VERSION);
+    generate_includes(1);
+    printf("\n");
+    print_lines(IO_RUNTIME);
+    printf("\n");
+    print_lines(COPY_RUNTIME);
+    printf("\n");
+    print_lines(TRANSFORM_RUNTIME);
+    printf("\n#endif\n");
+}
+
+/*
+ * generate_prelude()
+ *
+ * Prints the includes and macros every generated program starts with. With
+ * --runtime-header, the shared header comes first, so that the C compiler
+ * can use a precompiled copy of it.
+ */
+void generate_prelude(void) {
+    if (options.runtimeHeader) {
+        printf("#include \"%s\"\n", RUNTIME_HEADER);
+        printf("#if BF2C_RUNTIME_VERSION != %d\n", RUNTIME_VERSION);
+        printf("#error \"%s is from a different version of brainfuck2c\"\n", RUNTIME_HEADER);
+        printf("#endif\n");
+        if (options.checkpoint) {
+            printf("#if !BF_POSIX_IO\n");
+            printf("#error \"--checkpoint needs setitimer()\"\n");
+            printf("#endif\n");
+        }
+    } else {
+        generate_includes(0);
+    }
+    printf("\n");
+    printf("#define TAPE_SIZE %d\n\n", TAPE_SIZE);
+    if (haveProfile) {
+        printf("#if defined(__GNUC__)\n");
+        printf("#define BF_LIKELY(x) __builtin_expect(!!(x), 1)\n");
+        printf("#define BF_UNLIKELY(x) __builtin_expect(!!(x), 0)\n");
+        printf("#define BF_COLD __attribute__((cold, noinline))\n");
+        printf("#else\n");
+        printf("#define BF_LIKELY(x) (x)\n");
+        printf("#define BF_UNLIKELY(x) (x)\n");
+        printf("#define BF_COLD\n");
+        printf("#endif\n\n");
+    }
+    if (numWideOps > 0) {
+        // One 16-bit load, add and store where the cells are in host order,
+        // which the C compiler can keep in a register across a loop.
+        printf("#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__\n");
+        printf("#define BF_ADD16(p, k) do { unsigned short w_; memcpy(&w_, (p), 2); "
+               "w_ = (unsigned short)(w_ + (k)); memcpy((p), &w_, 2); } while (0)\n");
+        printf("#else\n");
+        printf("#define BF_ADD16(p, k) do { unsigned w_ = (p)[0] + 256u * (p)[1] + (k); "
+               "(p)[0] = (unsigned char)w_; (p)[1] = (unsigned char)(w_ >> 8); } while (0)\n");
+        printf("#endif\n\n");
+    }
+}
+
+/*
+ * count_inputs()
+ *
+ * Returns the number of ',' commands in the AST.
+ */
+int count_inputs(ASTNode* nodes, int numNodes) {
+    int count = 0;
+    for (int i = 0; i < numNodes; i++) {
+        if (nodes[i].type == TOKEN_INPUT) {
+            count += nodes[i].count;
+        } else if (nodes[i].type == TOKEN_LOOP_START) {
+            count += count_inputs(nodes[i].children, nodes[i].numChildren);
+        }
+    }
+    return count;
+}
+
+/*
+ * generate_resumable()
+ *
+ * Prints the program as a resumable session: bf_session_resume() runs the
+ * program until it ends or needs input that has not arrived yet. Every ','
+ * is a resume point; the switch at the top jumps back to the one the
+ * session stopped at, which C allows even inside loop bodies.
+ */
+void generate_resumable(ASTNode* ast, int numNodes) {
+    print_lines(SESSION_RUNTIME);
+    printf("\n");
+    if (numMemoSlots > 0) {
+        generate_memo_runtime();
+    }
+
+    int resumePoints = count_inputs(ast, numNodes);
+    printf("int bf_session_resume(bf_session *s, const unsigned char *in, size_t len, int at_eof) {\n");
+    printf("    unsigned char *ptr = s->tape + s->ptr;\n\n");
+    printf("    s->in = in;\n");
+    printf("    s->in_len = len;\n");
+    printf("    s->in_pos = 0;\n");
+    printf("    s->in_eof = at_eof;\n");
+    printf("    switch (s->state) {\n");
+    printf("        case 0:\n");
+    printf("            break;\n");
+    for (int k = 1; k <= resumePoints; k++) {
+        printf("        case %d:\n", k);
+        printf("            goto bf_input_%d;\n", k);
+    }
+    printf("        default:\n");
+    printf("            return BF_DONE;\n");
+    printf("    }\n\n");
+    generate_code(ast, numNodes, 1);
+    printf("\n    s->state = -1;\n");
+    printf("    s->ptr = (size_t)(ptr - s->tape);\n");
+    printf("    bf_session_flush(s);\n");
+    printf("    return BF_DONE;\n");
+    printf("}\n\n");
+    print_lines(SESSION_MAIN);
+}
+
+/*
+ * generate_pipeline()
+ *
+ * Prints a program that runs every stage of a pipeline on its own thread.
+ * Stage k reads what stage k - 1 writes through a ring buffer; the first
+ * stage reads standard input and the last one writes standard output. The
+ * program ends when the last stage does.
+ */
+void generate_pipeline(Stage *stages, int numStages) {
+    print_lines(IO_RUNTIME);
+    printf("\n");
+    print_lines(PIPELINE_RUNTIME);
+    printf("\n");
+    if (numMemoSlots > 0) {
+        generate_memo_runtime();
+    }
+    printf("static bf_ring bf_rings[%d];\n", numStages > 1 ? numStages - 1 : 1);
+    printf("static bf_stage bf_stages[%d];\n\n", numStages);
+    for (int k = 0; k < numStages; k++) {
+        printf("static void *bf_stage_%d(void *arg) {\n", k);
+        printf("    static unsigned char array[TAPE_SIZE];\n");
+        printf("    unsigned char *ptr = array;\n");
+        printf("    bf_stage *st = &bf_stages[%d];\n\n", k);
+        printf("    (void)arg;\n");
+        generate_code(stages[k].nodes, stages[k].numNodes, 1);
+        printf("\n    bf_stage_finish(st);\n");
+        printf("    return NULL;\n");
+        printf("}\n\n");
+    }
+    printf("int main(void) {\n");
+    printf("    static void *(*const bodies[%d])(void *) = {", numStages);
+    for (int k = 0; k < numStages; k++) {
+        printf("%sbf_stage_%d", k ? ", " : "", k);
+    }
+    printf("};\n");
+    printf("    pthread_t threads[%d];\n", numStages);
+    printf("    int k;\n\n");
+    printf("    bf_io_init();\n");
+    printf("    bf_flush_before_read = %d;\n", numStages == 1);
+    printf("    for (k = 0; k < %d; k++) {\n", numStages);
+    printf("        bf_stages[k].in = k > 0 ? &bf_rings[k - 1] : NULL;\n");
+    printf("        bf_stages[k].out = k < %d ? &bf_rings[k] : NULL;\n", numStages - 1);
+    printf("        if (k < %d) {\n", numStages - 1);
+    printf("            bf_ring_init(&bf_rings[k]);\n");
+    printf("        }\n");
+    printf("    }\n");
+    printf("    for (k = 0; k < %d; k++) {\n", numStages);
+    printf("        if (pthread_create(&threads[k], NULL, bodies[k], NULL) != 0) {\n");
+    printf("            fprintf(stderr, \"bf: cannot start pipeline stage %%d\\n\", k);\n");
+    printf("            return EXIT_FAILURE;\n");
+    printf("        }\n");
+    printf("    }\n");
+    printf("    pthread_join(threads[%d], NULL);\n", numStages - 1);
+    printf("    return 0;\n");
+    printf("}\n");
+}
+
+/*
+ * generate_batch()
+ *
+ * Prints a program that runs the bytecode for the AST over every input
+ * file given on its command line, BF_LANES files at a time.
+ */
+void generate_batch(ASTNode* ast, int numNodes) {
+    Bytecode bc = {0};
+    flatten(ast, numNodes, &bc);
+    emit_insn(&bc, BC_HALT, 0, NO_POSITION);
+    unsigned char *balanced = malloc(bc.count);
+    if (!balanced) {
+        perror("Memory allocation failed in generate_batch()");
+        exit(EXIT_FAILURE);
+    }
+    mark_balanced_loops(&bc, balanced);
+
+    print_bytecode(&bc);
+    printf("static const unsigned char bf_balanced[%d] = {", bc.count);
+    for (int i = 0; i < bc.count; i++) {
+        printf("%s%d%s", i % 32 == 0 ? "\n    " : "", balanced[i], i + 1 < bc.count ? "," : "");
+    }
+    printf("\n};\n\n");
+    print_lines(BATCH_RUNTIME);
+    free(balanced);
+    free(bc.code);
+}
+
+/*
+ * generate_program()
+ *
+ * Prints the complete C program for the AST.
+ */
+void generate_program(ASTNode* ast, int numNodes) {
+    generate_prelude();
+    if (options.resumable) {
+        generate_resumable(ast, numNodes);
+        return;
+    }
+    if (options.batch) {
+        generate_batch(ast, numNodes);
+        return;
+    }
+    if (has_limits()) {
+        generate_governor();
+    }
+    if (!options.runtimeHeader) {
+        print_lines(IO_RUNTIME);
+        printf("\n");
+    }
+    if (options.checkpoint) {
+        generate_checkpoint();
+    }
+    if (numCopyLoops > 0 && !options.runtimeHeader) {
+        print_lines(COPY_RUNTIME);
+        printf("\n");
+    }
+    if (numTransformLoops > 0) {
+        if (!options.runtimeHeader) {
+            print_lines(TRANSFORM_RUNTIME);
+            printf("\n");
+        }
+        generate_transform_tables();
+    }
+    if (options.profileGenerate) {
+        generate_profile_runtime();
+    }
+    if (numMemoSlots > 0) {
+        generate_memo_runtime();
+    }
+    generate_cold_functions(ast, numNodes);
+    if (options.hybrid) {
+        generate_native_functions(ast, numNodes);
+        generate_interpreter(ast, numNodes);
+    }
+    printf("int main(%s) {\n", options.checkpoint ? "int argc, char *argv[]" : "void");
+    printf("    %sunsigned char array[TAPE_SIZE] = {0};\n", options.hybrid ? "static " : "");
+    if (options.hybrid) {
+        printf("\n    bf_io_init();\n");
+        printf("    bf_interpret(array);\n");
+    } else {
+        printf("    unsigned char *ptr = array;\n\n");
+        printf("    bf_io_init();\n");
+        if (has_limits()) {
+            printf("    bf_governor_init();\n");
+            printf("    long bf_slice = 0;\n");
+            printf("    (void)bf_slice;\n");
+        }
+        if (options.profileGenerate) {
+            printf("    atexit(bf_prof_write);\n\n");
+        }
+        if (options.checkpoint) {
+            printf("    switch (bf_checkpoint_init(argc, argv, array, &ptr)) {\n");
+            generate_resume_cases(ast, numNodes, NULL);
+            printf("    default:\n");
+            printf("        break;\n");
+            printf("    }\n\n");
+        }
+        generate_code(ast, numNodes, 1);
     }
-    
-    // --- Lexer Phase ---
-    int numTokens = 0;
-    Token* tokens = lex(source, &numTokens);
-    free(source);
-    
-    // --- Parser Phase ---
-    int numASTNodes = 0;
-    ASTNode* ast = parseTokens(tokens, numTokens, &numASTNodes);
-    free(tokens);
-    
-    // --- Generator Phase ---
-    printf("#include <stdio.h>\n");
-    printf("#include <stdlib.h>\n\n");
-    printf("#define TAPE_SIZE %d\n\n", TAPE_SIZE);
-    printf("int main(void) {\n");
-    printf("    unsigned char array[TAPE_SIZE] = {0};\n");
-    printf("    unsigned char *ptr = array;\n\n");
-    
-    generate_code(ast, numASTNodes, 1);
     
     printf("\n    return 0;\n");
     printf("}\n");
+}
+
+/*
+ * free_ast()
+ *
+ * Recursively frees memory allocated for the AST.
+ */
+void free_ast(ASTNode* nodes, int numNodes) {
+    for (int i = 0; i < numNodes; i++) {
+        if ((nodes[i].type == TOKEN_LOOP_START || nodes[i].type == TOKEN_WIDE_ADD) &&
+            nodes[i].children != NULL) {
+            free_ast(nodes[i].children, nodes[i].numChildren);
+            free(nodes[i].children);
+        }
+    }
+}
+
+/*---------------------------------------------------------------
+ * Main Function: Integrating Lexer, Parser, and Generator
+ *--------------------------------------------------------------*/
+
+/*
+ * parse_limit()
+ *
+ * Parses the positive count given to a limit option, exiting with an error
+ * message if it is not one.
+ */
+unsigned long long parse_limit(const char *arg, const char *value) {
+    char *end;
+    unsigned long long limit = strtoull(value, &end, 10);
+    if (end == value || *end != '\0' || limit == 0 || value[0] == '-') {
+        fprintf(stderr, "Error: Invalid value in '%s'\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return limit;
+}
+
+/*
+ * parse_seconds()
+ *
+ * Parses the positive number of seconds given to an option, exiting with an
+ * error message if it is not one.
+ */
+double parse_seconds(const char *arg, const char *value) {
+    char *end;
+    double seconds = strtod(value, &end);
+    if (end == value || *end != '\0' || !(seconds > 0 && seconds < 1e9)) {
+        fprintf(stderr, "Error: Invalid value in '%s'\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return seconds;
+}
+
+/*
+ * parse_options()
+ *
+ * Fills in the global options from the command line. Exits with a usage
+ * message on unknown options.
+ */
+void parse_options(int argc, char *argv[]) {
+    options.flatDepth = DEFAULT_FLAT_DEPTH;
+    options.jobs = 1;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--profile-generate") == 0) {
+            options.profileGenerate = DEFAULT_PROFILE_FILE;
+        } else if (strncmp(arg, "--profile-generate=", 19) == 0) {
+            options.profileGenerate = arg + 19;
+        } else if (strncmp(arg, "--profile-use=", 14) == 0) {
+            options.profileUse = arg + 14;
+        } else if (strcmp(arg, "--memoize") == 0) {
+            options.memoize = 1;
+        } else if (strcmp(arg, "--hybrid") == 0) {
+            options.hybrid = 1;
+        } else if (strcmp(arg, "--resumable") == 0) {
+            options.resumable = 1;
+        } else if (strcmp(arg, "--pipeline") == 0) {
+            options.pipeline = 1;
+        } else if (strcmp(arg, "--batch") == 0) {
+            options.batch = 1;
+        } else if (strncmp(arg, "--flat-depth=", 13) == 0) {
+            // Zero is valid here, and flattens every loop.
+            unsigned long long depth = strcmp(arg + 13, "0") == 0 ? 0 : parse_limit(arg, arg + 13);
+            options.flatDepth = depth < INT_MAX ? (int)depth : INT_MAX;
+        } else if (strncmp(arg, "--max-steps=", 12) == 0) {
+            options.maxSteps = parse_limit(arg, arg + 12);
+        } else if (strncmp(arg, "--max-output=", 13) == 0) {
+            options.maxOutput = parse_limit(arg, arg + 13);
+        } else if (strncmp(arg, "--timeout=", 10) == 0) {
+            options.timeout = parse_seconds(arg, arg + 10);
+        } else if (strcmp(arg, "--checkpoint") == 0) {
+            options.checkpoint = DEFAULT_CHECKPOINT_FILE;
+        } else if (strncmp(arg, "--checkpoint=", 13) == 0) {
+            options.checkpoint = arg + 13;
+        } else if (strcmp(arg, "--runtime-header") == 0) {
+            options.runtimeHeader = 1;
+        } else if (strcmp(arg, "--emit-runtime-header") == 0) {
+            options.emitRuntimeHeader = 1;
+        } else if (strncmp(arg, "--emit-bfc=", 11) == 0) {
+            options.emitBfc = arg + 11;
+        } else if (strcmp(arg, "--check") == 0) {
+            options.check = 1;
+        } else if (strcmp(arg, "--line-directives") == 0) {
+            options.lineDirectives = 1;
+        } else if (strncmp(arg, "--jobs=", 7) == 0) {
+            unsigned long long jobs = parse_limit(arg, arg + 7);
+            options.jobs = jobs < MAX_JOBS ? (int)jobs : MAX_JOBS;
+        } else if (strncmp(arg, "--opt-fuel=", 11) == 0) {
+            unsigned long long fuel = parse_limit(arg, arg + 11);
+            options.optFuel = fuel < LLONG_MAX ? (long long)fuel : LLONG_MAX;
+        } else if (strncmp(arg, "--opt-budget-ms=", 16) == 0) {
+            options.optBudgetMs = parse_limit(arg, arg + 16);
+        } else if (strncmp(arg, "--run=", 6) == 0) {
+            options.runBfc = arg + 6;
+        } else if (strcmp(arg, "--remarks") == 0) {
+            options.remarks = "";
+        } else if (strncmp(arg, "--remarks=", 10) == 0) {
+            options.remarks = arg + 10;
+        } else if (strncmp(arg, "--checkpoint-interval=", 22) == 0) {
+            options.checkpointInterval = parse_seconds(arg, arg + 22);
+        } else if (arg[0] == '-' && arg[1] == '-') {
+            fprintf(stderr, "Error: Unknown option '%s'\n", arg);
+            fprintf(stderr, "Usage: %s [--profile-generate[=FILE]] [--profile-use=FILE] [--memoize] [--hybrid] [--flat-depth=N] [--resumable] [--batch] [--max-steps=N] [--max-output=N] [--timeout=SECONDS] [--checkpoint[=FILE]] [--checkpoint-interval=SECONDS] [--remarks[=FILE]] [--runtime-header] [--emit-runtime-header] [--emit-bfc=FILE] [--run=FILE] [--jobs=N] [--line-directives] [--check] [--opt-fuel=N] [--opt-budget-ms=N] [input.bf | --pipeline A.bf B.bf ...]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        } else {
+            options.inputPath = arg;
+            options.stagePaths = realloc(options.stagePaths, (options.numStagePaths + 1) * sizeof(char *));
+            if (!options.stagePaths) {
+                perror("Memory reallocation failed in parse_options()");
+                exit(EXIT_FAILURE);
+            }
+            options.stagePaths[options.numStagePaths++] = arg;
+        }
+    }
+    if (options.pipeline && options.numStagePaths == 0) {
+        fprintf(stderr, "Error: --pipeline needs at least one input file\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.pipeline && (options.hybrid || options.resumable ||
+                             options.profileGenerate || options.profileUse)) {
+        fprintf(stderr, "Error: --pipeline cannot be combined with --hybrid, --resumable or profiles\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.batch && (options.hybrid || options.resumable || options.pipeline ||
+                          options.memoize || options.profileGenerate || options.profileUse)) {
+        fprintf(stderr, "Error: --batch cannot be combined with --hybrid, --resumable, "
+                        "--pipeline, --memoize or profiles\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.checkpointInterval > 0 && !options.checkpoint) {
+        options.checkpoint = DEFAULT_CHECKPOINT_FILE;
+    }
+    if (options.runtimeHeader && (has_limits() || options.resumable || options.pipeline || options.batch)) {
+        fprintf(stderr, "Error: --runtime-header cannot be combined with execution limits, "
+                        "--resumable, --pipeline or --batch\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.lineDirectives && options.pipeline) {
+        fprintf(stderr, "Error: --line-directives cannot be combined with --pipeline\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.emitBfc && (has_limits() || options.checkpoint || options.hybrid || options.resumable ||
+                            options.pipeline || options.batch)) {
+        fprintf(stderr, "Error: --emit-bfc cannot be combined with execution limits, --checkpoint, "
+                        "--hybrid, --resumable, --pipeline or --batch\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.checkpoint && (options.hybrid || options.resumable || options.pipeline ||
+                               options.batch || options.memoize)) {
+        fprintf(stderr, "Error: --checkpoint cannot be combined with --hybrid, --resumable, "
+                        "--pipeline, --batch or --memoize\n");
+        exit(EXIT_FAILURE);
+    }
+    if (has_limits() && (options.hybrid || options.resumable || options.pipeline || options.batch)) {
+        fprintf(stderr, "Error: --max-steps, --max-output and --timeout cannot be combined with "
+                        "--hybrid, --resumable, --pipeline or --batch\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.resumable && (options.hybrid || options.profileGenerate)) {
+        fprintf(stderr, "Error: --resumable cannot be combined with --hybrid or --profile-generate\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.hybrid && options.profileGenerate) {
+        fprintf(stderr, "Error: --hybrid cannot be combined with --profile-generate; "
+                        "record the profile with a fully native build\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    parse_options(argc, argv);
+    if (options.emitRuntimeHeader) {
+        generate_runtime_header();
+        return 0;
+    }
+    if (options.runBfc) {
+        return run_bfc(options.runBfc);
+    }
+    if (options.check) {
+        return check_inputs();
+    }
+    int numStages = options.pipeline ? options.numStagePaths : 1;
+    Stage *stages = calloc(numStages, sizeof(Stage));
+    if (!stages) {
+        perror("Memory allocation failed for program stages");
+        exit(EXIT_FAILURE);
+    }
+    
+    programChecksum = 2166136261UL;
+    for (int k = 0; k < numStages; k++) {
+        const char *path = options.pipeline ? options.stagePaths[k] : options.inputPath;
+        Decoder *decoder = open_decoder(path);
+        if (!decoder) {
+            perror("Error opening input file");
+            exit(EXIT_FAILURE);
+        }
+        
+        // --- Lexer Phase ---
+        // A compressed file is streamed into the lexer rather than kept, and
+        // read again if positions are needed. Standard input can only be
+        // read once, so it is always kept.
+        size_t numTokens = 0;
+        size_t *brackets;
+        int keep = decoder->format == INPUT_PLAIN || !path;
+        Token* tokens = lex(decoder, keep, &stages[k].source.text, &numTokens, &brackets);
+        stages[k].source.path = path;
+        close_decoder(decoder);
+        
+        // --- Parser Phase ---
+        stages[k].nodes = parseTokens(tokens, numTokens, brackets, &stages[k].source, &stages[k].numNodes);
+        free(tokens);
+        free(brackets);
+        number_loops(stages[k].nodes, stages[k].numNodes, &numLoops);
+        programChecksum = ast_checksum(stages[k].nodes, stages[k].numNodes, programChecksum);
+    }
+    loopInfo = calloc(numLoops > 0 ? numLoops : 1, sizeof(LoopInfo));
+    if (!loopInfo) {
+        perror("Memory allocation failed for loop information");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < numLoops; i++) {
+        loopInfo[i].valueSlot = loopInfo[i].memoSlot = loopInfo[i].nativeSlot = -1;
+    }
+    ASTNode* ast = stages[0].nodes;
+    int numASTNodes = stages[0].numNodes;
+    programSource = &stages[0].source;
+    assign_value_slots(ast, numASTNodes);
+    start_opt_budget();
+    
+    // --- Profile Phase ---
+    if (options.profileUse && load_profile(options.profileUse)) {
+        haveProfile = 1;
+        apply_profile(ast, numASTNodes);
+    }
+    
+    // --- Optimizer Phase ---
+    for (int k = 0; k < numStages; k++) {
+        fold_wide_adds(stages[k].nodes, &stages[k].numNodes, 0);
+    }
+    numASTNodes = stages[0].numNodes;
+    // Bulk copies block on input, which a session must never do, work on
+    // the process-wide input and output buffers, do work the governor
+    // cannot charge for, and move the input offset behind the checkpoint's
+    // back.
+    run_loop_passes(stages, numStages, !options.resumable && !options.pipeline && !options.batch &&
+                                       !has_limits() && !options.checkpoint);
+    for (int k = 0; options.memoize && k < numStages; k++) {
+        assign_memo_slots(stages[k].nodes, stages[k].numNodes);
+    }
+    if (opt_budget_spent()) {
+        fprintf(stderr, "Warning: Optimization budget ran out; some loops were left unoptimized\n");
+    }
+    if (options.hybrid) {
+        mark_native_loops(ast, numASTNodes, 0);
+    }
+    
+    // --- Remarks Phase ---
+    if (options.remarks) {
+        write_remarks(stages, numStages);
+    }
+    
+    // --- Generator Phase ---
+    if (options.emitBfc) {
+        write_bfc(options.emitBfc, ast, numASTNodes, &stages[0].source);
+    } else if (options.pipeline) {
+        generate_prelude();
+        generate_pipeline(stages, numStages);
+    } else {
+        generate_program(ast, numASTNodes);
+    }
     
-    free_ast(ast, numASTNodes);
-    free(ast);
+    close_source_positions();
+    for (int k = 0; k < numStages; k++) {
+        free_ast(stages[k].nodes, stages[k].numNodes);
+        free(stages[k].nodes);
+        free(stages[k].source.text);
+    }
+    free(stages);
+    for (int i = 0; i < numLoops; i++) {
+        free(loopInfo[i].values);
+        free(loopInfo[i].map);
+        free(loopInfo[i].hoisted);
+    }
+    free(loopInfo);
+    free(wideOps);
+    free(options.stagePaths);
     
     return 0;
 }
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# checkpoint_build.sh
+#
+# Builds programs with --checkpoint whose loops are not all printed as C
+# loops, such as clear loops hoisted out of their parent loop, and checks
+# that the generated code compiles and prints what the program does: the
+# switch that resumes from a checkpoint may only jump to safepoints that
+# exist.
+#
+# Usage:
+#   tests/checkpoint_build.sh
+#
+# Environment:
+#   CC       C compiler (default: cc)
+#
+
+set -e
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$TESTS_DIR")
+CC=${CC:-cc}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+$CC -O2 -o "$WORK/brainfuck2c" "$ROOT/brainfuck2c.c"
+
+# Each case is a program and the octal code of the byte it prints.
+check() {
+    printf '%s' "$1" > "$WORK/test.bf"
+    "$WORK/brainfuck2c" --checkpoint "$WORK/test.bf" > "$WORK/test.c"
+    if ! $CC -O2 -o "$WORK/test" "$WORK/test.c"; then
+        echo "FAIL: $1 does not compile with --checkpoint" >&2
+        exit 1
+    fi
+    if [ "$("$WORK/test" | od -An -to1 | tr -d ' ')" != "$2" ]; then
+        echo "FAIL: $1 prints the wrong byte with --checkpoint" >&2
+        exit 1
+    fi
+}
+
+check '+++[>[---]+<-]>.' 001
+check '+++[>[-]+<-]>.' 001
+check '++[>+++[>>[-----]++<<-]<-]>>>.' 002
+check '+++[>++[>[---]+<-]<-]>>.' 001
+echo "checkpoint builds OK"
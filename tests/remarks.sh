@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# remarks.sh
+#
+# Checks that --remarks reports a counted loop as applied only where the
+# analysis changes the generated code. In a default build a counted loop
+# such as [->+<] is printed as the same while loop as any other, so the
+# report must not claim it; under --max-steps it is charged before it runs,
+# and with --checkpoint it needs no safepoint. Loops that are not counted
+# loops are reported as missed, with the reason.
+#
+# Usage:
+#   tests/remarks.sh
+#
+# Environment:
+#   CC       C compiler (default: cc)
+#
+
+set -e
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$TESTS_DIR")
+CC=${CC:-cc}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+$CC -O2 -o "$WORK/brainfuck2c" "$ROOT/brainfuck2c.c"
+printf '++[->+<]>[>]<.' > "$WORK/test.bf"
+
+# Runs the transpiler with the given options and checks whether a line of
+# the report contains the text.
+expect() {
+    want=$1
+    line=$2
+    shift 2
+    "$WORK/brainfuck2c" --remarks="$WORK/remarks" "$@" "$WORK/test.bf" > /dev/null
+    if grep -qF "$line" "$WORK/remarks"; then found=yes; else found=no; fi
+    if [ "$found" != "$want" ]; then
+        echo "FAIL: with options '$*', expected '$line' to be reported: $want" >&2
+        cat "$WORK/remarks" >&2
+        exit 1
+    fi
+}
+
+expect no  '    applied  counted loop: step -1'
+expect yes '    missed   counted loop: unbalanced pointer'
+expect yes '    applied  counted loop: step -1, charged before it runs' --max-steps=1000
+expect yes '    applied  counted loop: step -1, no safepoint' --checkpoint
+echo "remarks OK"
@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# ring_stress.sh
+#
+# Stress test for the rings between --pipeline stages. A chain of stages
+# that copy, double and halve their input is built with a ring of a few
+# bytes, so that every stage keeps filling and draining its rings and both
+# sides of each ring go to sleep over and over. The output must match the
+# input, and every run must end within the time limit: a lost wakeup shows
+# up as a hang.
+#
+# Usage:
+#   tests/ring_stress.sh [runs]
+#
+# Environment:
+#   CC       C compiler (default: cc)
+#   SIZES    Ring sizes to try (default: "1 2 7 64")
+#   LIMIT    Seconds a run may take (default: 20)
+#
+
+set -e
+
+TESTS_DIR=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(dirname "$TESTS_DIR")
+CC=${CC:-cc}
+SIZES=${SIZES:-"1 2 7 64"}
+LIMIT=${LIMIT:-20}
+RUNS=${1:-10}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+$CC -O2 -o "$WORK/brainfuck2c" "$ROOT/brainfuck2c.c"
+# End of input reads as 255, which the programs stop on and the input
+# leaves out.
+printf ',+[-.,+]' > "$WORK/copy.bf"
+printf ',+[-..,+]' > "$WORK/double.bf"
+printf ',+[-.,,+]' > "$WORK/halve.bf"
+"$WORK/brainfuck2c" --pipeline "$WORK/copy.bf" "$WORK/double.bf" "$WORK/halve.bf" \
+    "$WORK/double.bf" "$WORK/halve.bf" "$WORK/copy.bf" > "$WORK/chain.c"
+head -c 50000 /dev/urandom | tr -d '\377' > "$WORK/input"
+
+for size in $SIZES; do
+    $CC -O2 -pthread -DBF_RING_SIZE="$size" -o "$WORK/chain" "$WORK/chain.c"
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        if ! timeout "$LIMIT" "$WORK/chain" < "$WORK/input" > "$WORK/output"; then
+            echo "FAIL: ring size $size, run $i did not finish" >&2
+            exit 1
+        fi
+        if ! cmp -s "$WORK/input" "$WORK/output"; then
+            echo "FAIL: ring size $size, run $i changed the data" >&2
+            exit 1
+        fi
+        i=$((i + 1))
+    done
+    echo "ring size $size: $RUNS runs OK"
+done